@@ -0,0 +1,279 @@
+/*
+QScripts monitor benchmark.
+
+Generates synthetic dependency trees in a temporary directory and times the
+monitor internals on them, without the IDA UI or a database:
+
+    parse       activating the script (parsing all the index files and watching the files)
+    expand      expanding a reload directive with $pkgmodname$ for each dependency
+    abspath     resolving a relative dependency path against its index directory
+    scan        one monitor pass without changes (polling and native backends)
+    detect      one monitor pass after all the dependencies were touched
+
+Usage: qscripts_bench [sizes...] (defaults to 10 1000 10000)
+*/
+#define QSCRIPTS_BENCH
+#include "../qscripts.cpp"
+
+#include <cmath>
+
+namespace fs = std::filesystem;
+
+//-------------------------------------------------------------------------
+// Synthetic dependency tree shapes
+enum class tree_shape_e
+{
+    wide,       // The main script lists all the dependencies
+    deep,       // Each dependency has an index file listing the next one
+    diamond,    // sqrt(n) top modules all depending on the same sqrt(n) shared modules
+    pkg,        // Package modules using $pkgbase$ and a $pkgmodname$ reload directive
+};
+
+static const char *shape_name(tree_shape_e shape)
+{
+    switch (shape)
+    {
+        case tree_shape_e::wide:    return "wide";
+        case tree_shape_e::deep:    return "deep";
+        case tree_shape_e::diamond: return "diamond";
+        case tree_shape_e::pkg:     return "pkg";
+    }
+    return "?";
+}
+
+//-------------------------------------------------------------------------
+struct bench_tree_t
+{
+    fs::path root;
+    qstring main_script;
+
+    // Every generated dependency script
+    qstrvec_t dep_files;
+
+    static void write_file(const fs::path &path, const qstring &body)
+    {
+        fs::create_directories(path.parent_path());
+        FILE *fp = qfopen(path.u8string().c_str(), "wb");
+        if (fp == nullptr)
+        {
+            fprintf(stderr, "cannot create '%s'\n", path.u8string().c_str());
+            exit(1);
+        }
+        qfwrite(fp, body.c_str(), body.length());
+        qfclose(fp);
+    }
+
+    void add_dep(const fs::path &path)
+    {
+        write_file(path, "x = 1\n");
+        dep_files.push_back(path.lexically_normal().u8string().c_str());
+    }
+
+    void generate(tree_shape_e shape, size_t n)
+    {
+        qstring deps;
+        auto main_path = root / "main.py";
+        write_file(main_path, "print('main')\n");
+        main_script = main_path.u8string().c_str();
+
+        switch (shape)
+        {
+            case tree_shape_e::wide:
+            {
+                deps = "/reload import importlib; importlib.reload($basename$)\n";
+                for (size_t i = 0; i < n; ++i)
+                {
+                    deps.cat_sprnt("mods/mod_%zu.py\n", i);
+                    add_dep(root / "mods" / qstring().sprnt("mod_%zu.py", i).c_str());
+                }
+                break;
+            }
+            case tree_shape_e::deep:
+            {
+                deps = "chain/c_0.py\n";
+                for (size_t i = 0; i < n; ++i)
+                {
+                    auto dep = root / "chain" / qstring().sprnt("c_%zu.py", i).c_str();
+                    add_dep(dep);
+                    if (i + 1 < n)
+                        write_file(dep.u8string() + ".deps.qscripts", qstring().sprnt("c_%zu.py\n", i + 1));
+                }
+                break;
+            }
+            case tree_shape_e::diamond:
+            {
+                size_t m = qmax(size_t(1), size_t(std::sqrt(double(n))));
+                qstring shared;
+                for (size_t j = 0; j < m; ++j)
+                {
+                    shared.cat_sprnt("../shared/s_%zu.py\n", j);
+                    add_dep(root / "shared" / qstring().sprnt("s_%zu.py", j).c_str());
+                }
+                for (size_t i = 0; i < m; ++i)
+                {
+                    auto dep = root / "top" / qstring().sprnt("t_%zu.py", i).c_str();
+                    deps.cat_sprnt("top/t_%zu.py\n", i);
+                    add_dep(dep);
+                    write_file(dep.u8string() + ".deps.qscripts", shared);
+                }
+                break;
+            }
+            case tree_shape_e::pkg:
+            {
+                deps = "/pkgbase pkgroot\n"
+                       "/reload import importlib; importlib.reload(sys.modules['$pkgmodname$'])\n";
+                for (size_t i = 0; i < n; ++i)
+                {
+                    deps.cat_sprnt("$pkgbase$/pkg/sub_%zu/mod_%zu.py\n", i / 100, i);
+                    add_dep(root / "pkgroot" / "pkg" / qstring().sprnt("sub_%zu", i / 100).c_str() / qstring().sprnt("mod_%zu.py", i).c_str());
+                }
+                break;
+            }
+        }
+        write_file(main_path.u8string() + ".deps.qscripts", deps);
+    }
+
+    // Bumps the time stamp of all the dependencies
+    void touch_all()
+    {
+        auto now = fs::file_time_type::clock::now();
+        for (auto &dep: dep_files)
+            fs::last_write_time(fs::u8path(dep.c_str()), now);
+    }
+};
+
+//-------------------------------------------------------------------------
+struct qscripts_bench_t
+{
+    struct result_t
+    {
+        uint64 parse_us    = 0;
+        double expand_ns   = 0;
+        double abspath_ns  = 0;
+        uint64 scan_poll_us   = 0;
+        uint64 scan_native_us = 0;
+        uint64 detect_us   = 0;
+        size_t ndeps       = 0;
+        size_t nindices    = 0;
+    };
+
+    static result_t run(const bench_tree_t &tree)
+    {
+        result_t r;
+        std::unique_ptr<qscripts_chooser_t> ch(new qscripts_chooser_t());
+        ch->opt_change_interval = ch->normalize_filemon_interval(ch->opt_change_interval);
+
+        // Time the parsing itself, not the graph cache
+        ch->opt_deps_cache = 0;
+
+        // Activate the main script
+        stopwatch_t sw;
+        script_info_t main_script(tree.main_script.c_str());
+        main_script.refresh();
+        ch->set_selected_script(main_script);
+        r.parse_us = sw.elapsed_us();
+        r.ndeps    = ch->selected_script.dep_scripts.size();
+        r.nindices = ch->selected_script.dep_indices.size();
+        ch->activate_monitor(true);
+
+        // Reload directive expansion
+        expand_template_t tpl("import importlib; importlib.reload(sys.modules['$pkgmodname$'])");
+        {
+            qstring out;
+            qscripts_chooser_t::expand_ctx_t ctx;
+            sw.reset();
+            for (auto &dep: tree.dep_files)
+            {
+                ctx.script_file = dep;
+                ch->expand_string(tpl, out, ctx);
+            }
+            r.expand_ns = tree.dep_files.empty() ? 0 : sw.elapsed_us() * 1000.0 / tree.dep_files.size();
+        }
+
+        // Path resolution
+        {
+            qstring base_dir = tree.root.u8string().c_str();
+            qstrvec_t rel_paths;
+            for (size_t i = 0; i < tree.dep_files.size(); ++i)
+                rel_paths.push_back().sprnt("sub_%zu" SDIRCHAR ".." SDIRCHAR "mods" SDIRCHAR "mod_%zu.py", i % 100, i);
+
+            sw.reset();
+            for (auto &path: rel_paths)
+                make_abs_path(path, base_dir.c_str(), true);
+            r.abspath_ns = rel_paths.empty() ? 0 : sw.elapsed_us() * 1000.0 / rel_paths.size();
+        }
+
+        // Steady state scan with the native backend (if any) then with polling
+        ch->filemon_timer_cb();
+        sw.reset();
+        ch->filemon_timer_cb();
+        r.scan_native_us = sw.elapsed_us();
+
+        ch->m_filemon.use_polling();
+        ch->filemon_timer_cb();
+        sw.reset();
+        ch->filemon_timer_cb();
+        r.scan_poll_us = sw.elapsed_us();
+
+        // Change detection of all the dependencies (no plan is executed)
+        const_cast<bench_tree_t &>(tree).touch_all();
+        sw.reset();
+        {
+            std::lock_guard<std::recursive_mutex> lock(ch->m_mutex);
+            ch->m_filemon.poll();
+            auto &stats = ch->m_filemon.scan();
+            ch->collect_changes(ch->selected_script, stats);
+            ch->m_filemon.done();
+            ch->selected_script.batch.clear();
+        }
+        r.detect_us = sw.elapsed_us();
+
+        ch->activate_monitor(false);
+        ch->clear_selected_script();
+        return r;
+    }
+};
+
+//-------------------------------------------------------------------------
+int main(int argc, char *argv[])
+{
+    qvector<size_t> sizes;
+    for (int i = 1; i < argc; ++i)
+        sizes.push_back(size_t(strtoull(argv[i], nullptr, 10)));
+    if (sizes.empty())
+    {
+        sizes.push_back(10);
+        sizes.push_back(1000);
+        sizes.push_back(10000);
+    }
+
+    auto base = fs::temp_directory_path() / qstring().sprnt("qscripts_bench_%" FMT_64 "u", uint64(time(nullptr))).c_str();
+
+    printf("%-8s %7s %7s %7s %10s %10s %10s %10s %12s %10s\n",
+        "shape", "n", "deps", "indices", "parse_ms", "expand_ns", "abspath_ns", "scan_ms", "scan_poll_ms", "detect_ms");
+
+    static const tree_shape_e shapes[] = { tree_shape_e::wide, tree_shape_e::deep, tree_shape_e::diamond, tree_shape_e::pkg };
+    for (auto n: sizes)
+    {
+        for (auto shape: shapes)
+        {
+            bench_tree_t tree;
+            tree.root = base / qstring().sprnt("%s_%zu", shape_name(shape), n).c_str();
+            tree.generate(shape, n);
+
+            auto r = qscripts_bench_t::run(tree);
+            printf("%-8s %7zu %7zu %7zu %10.3f %10.1f %10.1f %10.3f %12.3f %10.3f\n",
+                shape_name(shape), n, r.ndeps, r.nindices,
+                r.parse_us / 1000.0, r.expand_ns, r.abspath_ns,
+                r.scan_native_us / 1000.0, r.scan_poll_us / 1000.0, r.detect_us / 1000.0);
+            fflush(stdout);
+
+            std::error_code ec;
+            fs::remove_all(tree.root, ec);
+        }
+    }
+
+    std::error_code ec;
+    fs::remove_all(base, ec);
+    return 0;
+}
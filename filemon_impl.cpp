@@ -0,0 +1,684 @@
+//-------------------------------------------------------------------------
+// File change monitor backends
+//
+// A backend watches the directories of the monitored files and queues
+// the paths that changed in them. The monitor then only has to look at
+// the queued files instead of stat'ing every watched file on each tick.
+// When no native backend is available, the polling backend is used: it
+// simply requests a full rescan each time it is drained.
+
+// The set of changed files drained from a backend
+using filemon_changes_t = std::unordered_set<std::string>;
+
+// How often the watched directories that went away are looked for
+static constexpr int FILEMON_LOST_DIR_INTERVAL = 1000;
+
+//-------------------------------------------------------------------------
+struct filemon_backend_t
+{
+    virtual ~filemon_backend_t() {}
+
+    virtual const char *name() const = 0;
+
+    // Event based backends have no need to be polled frequently
+    virtual bool is_polling() const { return false; }
+
+    // Start watching a directory and the given files inside it.
+    // Returns false if the directory cannot be watched.
+    virtual bool add_dir(const char *dir, const qstrvec_t &files) = 0;
+
+    // Stop watching all directories
+    virtual void clear() = 0;
+
+    // Moves the queued changes into 'changes'.
+    // Returns false if events were lost and a full rescan is required.
+    virtual bool drain(filemon_changes_t &changes) = 0;
+
+    // A descriptor that becomes readable when changes are queued, or -1 if the backend has to
+    // be drained on a short timer. The monitor blocks on it between the drains.
+    virtual int event_fd() const { return -1; }
+
+    // Some watched directories went away: drain from time to time to watch them again
+    virtual bool has_lost_dirs() const { return false; }
+};
+
+//-------------------------------------------------------------------------
+// Fallback backend: every drain asks for a full rescan
+struct filemon_poll_backend_t: filemon_backend_t
+{
+    const char *name() const override { return "polling"; }
+    bool is_polling() const override  { return true; }
+
+    bool add_dir(const char *, const qstrvec_t &) override { return true; }
+    void clear() override {}
+    bool drain(filemon_changes_t &) override { return false; }
+};
+
+#if defined(__LINUX__)
+//-------------------------------------------------------------------------
+// Linux: inotify on a non-blocking descriptor, drained when it becomes readable
+struct filemon_inotify_backend_t: filemon_backend_t
+{
+    static constexpr uint32 WATCH_MASK =
+        IN_CLOSE_WRITE | IN_MODIFY | IN_ATTRIB | IN_CREATE
+      | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_DELETE_SELF;
+
+    // The directory paths of a watch descriptor (watching the same directory through
+    // different paths yields the same descriptor) and the watched files in them
+    struct watch_t
+    {
+        qstrvec_t dirs;
+        qstrvec_t files;
+    };
+
+    int fd = -1;
+    std::unordered_map<int, watch_t> wd_dirs;
+
+    // The directories that went away, watched again once they reappear
+    qvector<std::pair<qstring, qstrvec_t>> lost;
+
+    filemon_inotify_backend_t()
+    {
+        fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    }
+
+    ~filemon_inotify_backend_t()
+    {
+        if (fd != -1)
+            close(fd);
+    }
+
+    bool ok() const { return fd != -1; }
+
+    const char *name() const override { return "inotify"; }
+
+    int event_fd() const override { return fd; }
+
+    bool has_lost_dirs() const override { return !lost.empty(); }
+
+    bool add_dir(const char *dir, const qstrvec_t &files) override
+    {
+        int wd = inotify_add_watch(fd, dir, WATCH_MASK);
+        if (wd == -1)
+            return false;
+
+        auto &w = wd_dirs[wd];
+        w.dirs.add_unique(dir);
+        for (auto &file: files)
+            w.files.add_unique(file);
+        return true;
+    }
+
+    void clear() override
+    {
+        // The removed watches queue IN_IGNORED events: they are skipped as their
+        // descriptors are no longer known
+        for (auto &kv: wd_dirs)
+            inotify_rm_watch(fd, kv.first);
+        wd_dirs.clear();
+        lost.qclear();
+    }
+
+    static void add_changes(filemon_changes_t &changes, const qstrvec_t &files)
+    {
+        for (auto &file: files)
+            changes.insert(filemon_key(file.c_str()));
+    }
+
+    bool drain(filemon_changes_t &changes) override
+    {
+        // Watch the directories that reappeared: their files may have changed meanwhile
+        for (size_t i = 0; i < lost.size(); )
+        {
+            if (add_dir(lost[i].first.c_str(), lost[i].second))
+            {
+                add_changes(changes, lost[i].second);
+                lost.erase(lost.begin() + i);
+            }
+            else
+            {
+                ++i;
+            }
+        }
+
+        bool ok = true;
+        alignas(struct inotify_event) char buf[16 * 1024];
+        for (;;)
+        {
+            ssize_t len = read(fd, buf, sizeof(buf));
+            if (len <= 0)
+                break;
+
+            for (char *p = buf; p < buf + len; )
+            {
+                auto ev = (const struct inotify_event *)p;
+                p += sizeof(struct inotify_event) + ev->len;
+
+                if ((ev->mask & IN_Q_OVERFLOW) != 0)
+                {
+                    ok = false;
+                    continue;
+                }
+
+                auto p_dirs = wd_dirs.find(ev->wd);
+                if (p_dirs == wd_dirs.end())
+                    continue;
+
+                // The directory itself went away: all of its files changed
+                if ((ev->mask & (IN_DELETE_SELF | IN_IGNORED)) != 0)
+                {
+                    add_changes(changes, p_dirs->second.files);
+                    if ((ev->mask & IN_IGNORED) != 0)
+                    {
+                        for (auto &dir: p_dirs->second.dirs)
+                            lost.push_back(std::make_pair(dir, p_dirs->second.files));
+                        wd_dirs.erase(p_dirs);
+                    }
+                    continue;
+                }
+
+                if (ev->len == 0)
+                    continue;
+
+                for (auto &dir: p_dirs->second.dirs)
+                {
+                    qstring path;
+                    path.sprnt("%s" SDIRCHAR "%s", dir.c_str(), ev->name);
+                    changes.insert(filemon_key(path.c_str()));
+                }
+            }
+        }
+        return ok;
+    }
+};
+#elif defined(__NT__)
+//-------------------------------------------------------------------------
+// MS Windows: overlapped ReadDirectoryChangesW, completion checked from the timer
+struct filemon_rdcw_backend_t: filemon_backend_t
+{
+    struct watch_t
+    {
+        qstring dir;
+        HANDLE hdir = INVALID_HANDLE_VALUE;
+        OVERLAPPED ov = {};
+        DWORD buf[16 * 1024 / sizeof(DWORD)];
+
+        bool arm()
+        {
+            return ReadDirectoryChangesW(
+                hdir,
+                buf,
+                sizeof(buf),
+                FALSE,
+                FILE_NOTIFY_CHANGE_FILE_NAME | FILE_NOTIFY_CHANGE_LAST_WRITE
+              | FILE_NOTIFY_CHANGE_SIZE | FILE_NOTIFY_CHANGE_CREATION,
+                nullptr,
+                &ov,
+                nullptr) != FALSE;
+        }
+
+        ~watch_t()
+        {
+            if (hdir != INVALID_HANDLE_VALUE)
+            {
+                // Wait for the cancelled read so it does not write into a freed buffer
+                DWORD nbytes;
+                if (CancelIo(hdir))
+                    GetOverlappedResult(hdir, &ov, &nbytes, TRUE);
+                CloseHandle(hdir);
+            }
+            if (ov.hEvent != nullptr)
+                CloseHandle(ov.hEvent);
+        }
+    };
+    std::vector<std::unique_ptr<watch_t>> watches;
+
+    const char *name() const override { return "ReadDirectoryChangesW"; }
+
+    bool add_dir(const char *dir, const qstrvec_t &) override
+    {
+        std::unique_ptr<watch_t> w(new watch_t);
+        w->dir = dir;
+
+        qwstring wdir;
+        utf8_utf16(&wdir, dir);
+        w->hdir = CreateFileW(
+            wdir.c_str(),
+            FILE_LIST_DIRECTORY,
+            FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
+            nullptr,
+            OPEN_EXISTING,
+            FILE_FLAG_BACKUP_SEMANTICS | FILE_FLAG_OVERLAPPED,
+            nullptr);
+        if (w->hdir == INVALID_HANDLE_VALUE)
+            return false;
+
+        w->ov.hEvent = CreateEventW(nullptr, TRUE, FALSE, nullptr);
+        if (w->ov.hEvent == nullptr || !w->arm())
+            return false;
+
+        watches.push_back(std::move(w));
+        return true;
+    }
+
+    void clear() override
+    {
+        watches.clear();
+    }
+
+    bool drain(filemon_changes_t &changes) override
+    {
+        bool ok = true;
+        for (auto &w: watches)
+        {
+            DWORD nbytes;
+            if (!GetOverlappedResult(w->hdir, &w->ov, &nbytes, FALSE))
+            {
+                if (GetLastError() != ERROR_IO_INCOMPLETE)
+                    ok = false;
+                continue;
+            }
+
+            // A zero length completion means the notification buffer overflowed
+            if (nbytes == 0)
+                ok = false;
+
+            for (auto p = (const BYTE *)w->buf; nbytes != 0; )
+            {
+                auto fni = (const FILE_NOTIFY_INFORMATION *)p;
+
+                qstring name;
+                utf16_utf8(&name, (const wchar16_t *)fni->FileName, fni->FileNameLength / sizeof(WCHAR));
+
+                qstring path;
+                path.sprnt("%s" SDIRCHAR "%s", w->dir.c_str(), name.c_str());
+                changes.insert(filemon_key(path.c_str()));
+
+                if (fni->NextEntryOffset == 0)
+                    break;
+                p += fni->NextEntryOffset;
+            }
+
+            ResetEvent(w->ov.hEvent);
+            if (!w->arm())
+                ok = false;
+        }
+        return ok;
+    }
+};
+#elif defined(__MAC__)
+//-------------------------------------------------------------------------
+// macOS: kqueue vnode events on the directories and on the watched files.
+// Directory events only cover entries being added or removed (atomic saves),
+// so the files are watched individually to catch in-place writes.
+struct filemon_kqueue_backend_t: filemon_backend_t
+{
+    struct watch_t
+    {
+        qstring dir;
+        qstrvec_t files;
+        int dir_fd = -1;
+        qvector<int> file_fds;
+    };
+    int kq = -1;
+    qvector<watch_t> watches;
+
+    filemon_kqueue_backend_t()
+    {
+        kq = kqueue();
+    }
+
+    ~filemon_kqueue_backend_t()
+    {
+        clear();
+        if (kq != -1)
+            close(kq);
+    }
+
+    bool ok() const { return kq != -1; }
+
+    const char *name() const override { return "kqueue"; }
+
+    int event_fd() const override { return kq; }
+
+    // The event's udata encodes the watch index and the file index (0 for the directory itself)
+    int open_and_register(const char *path, size_t iwatch, size_t ifile)
+    {
+        int fd = open(path, O_EVTONLY);
+        if (fd == -1)
+            return -1;
+
+        struct kevent kev;
+        EV_SET(&kev, fd, EVFILT_VNODE, EV_ADD | EV_CLEAR,
+               NOTE_WRITE | NOTE_EXTEND | NOTE_ATTRIB | NOTE_DELETE | NOTE_RENAME,
+               0, (void *)(uintptr_t)((iwatch << 16) | ifile));
+        if (kevent(kq, &kev, 1, nullptr, 0, nullptr) == -1)
+        {
+            close(fd);
+            return -1;
+        }
+        return fd;
+    }
+
+    // (Re)open the watched files of a directory. Missing files are not an error.
+    void open_files(size_t iwatch)
+    {
+        auto &w = watches[iwatch];
+        for (auto fd: w.file_fds)
+        {
+            if (fd != -1)
+                close(fd);
+        }
+        w.file_fds.qclear();
+        for (size_t i = 0; i < w.files.size(); ++i)
+            w.file_fds.push_back(open_and_register(w.files[i].c_str(), iwatch, i + 1));
+    }
+
+    bool add_dir(const char *dir, const qstrvec_t &files) override
+    {
+        size_t iwatch = watches.size();
+        int dir_fd = open_and_register(dir, iwatch, 0);
+        if (dir_fd == -1)
+            return false;
+
+        auto &w  = watches.push_back();
+        w.dir    = dir;
+        w.files  = files;
+        w.dir_fd = dir_fd;
+        open_files(iwatch);
+        return true;
+    }
+
+    void clear() override
+    {
+        for (auto &w: watches)
+        {
+            for (auto fd: w.file_fds)
+            {
+                if (fd != -1)
+                    close(fd);
+            }
+            close(w.dir_fd);
+        }
+        watches.qclear();
+    }
+
+    bool drain(filemon_changes_t &changes) override
+    {
+        bool ok = true;
+        struct kevent events[64];
+        struct timespec zero = {};
+        int n;
+        while ((n = kevent(kq, nullptr, 0, events, qnumber(events), &zero)) > 0)
+        {
+            for (int i = 0; i < n; ++i)
+            {
+                auto ud = (uintptr_t)events[i].udata;
+                size_t iwatch = ud >> 16, ifile = ud & 0xffff;
+                if (iwatch >= watches.size())
+                    continue;
+
+                auto &w = watches[iwatch];
+                if (ifile == 0)
+                {
+                    // Entries were added, removed or renamed: files may have been replaced
+                    for (auto &file: w.files)
+                        changes.insert(filemon_key(file.c_str()));
+                    open_files(iwatch);
+                }
+                else if (ifile <= w.files.size())
+                {
+                    changes.insert(filemon_key(w.files[ifile - 1].c_str()));
+                    if ((events[i].fflags & (NOTE_DELETE | NOTE_RENAME)) != 0)
+                        open_files(iwatch);
+                }
+            }
+        }
+        if (n == -1)
+            ok = false;
+        return ok;
+    }
+};
+#endif
+
+#if !defined(__NT__)
+//-------------------------------------------------------------------------
+// Blocks a thread until the events of a backend are queued or another thread wakes it up
+class filemon_waiter_t
+{
+    int m_fds[2] = { -1, -1 };
+
+public:
+    filemon_waiter_t()
+    {
+        if (pipe(m_fds) != 0)
+        {
+            m_fds[0] = m_fds[1] = -1;
+            return;
+        }
+        for (int fd: m_fds)
+        {
+            fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+            fcntl(fd, F_SETFD, FD_CLOEXEC);
+        }
+    }
+
+    ~filemon_waiter_t()
+    {
+        for (int fd: m_fds)
+        {
+            if (fd != -1)
+                close(fd);
+        }
+    }
+
+    bool ok() const { return m_fds[0] != -1; }
+
+    void wake()
+    {
+        char c = 0;
+        if (m_fds[1] != -1 && write(m_fds[1], &c, 1) < 0)
+            return;
+    }
+
+    // Waits up to 'timeout_ms' for 'event_fd' to become readable or for a wake up
+    void wait(int event_fd, int timeout_ms)
+    {
+        pollfd pfds[2] = { { event_fd, POLLIN, 0 }, { m_fds[0], POLLIN, 0 } };
+        if (poll(pfds, 2, timeout_ms) > 0 && (pfds[1].revents & POLLIN) != 0)
+        {
+            char buf[64];
+            while (read(m_fds[0], buf, sizeof(buf)) > 0)
+                ;
+        }
+    }
+};
+#endif
+
+//-------------------------------------------------------------------------
+// Creates the best backend for the current platform
+inline filemon_backend_t *create_filemon_backend()
+{
+#if defined(__LINUX__)
+    auto inotify = new filemon_inotify_backend_t();
+    if (inotify->ok())
+        return inotify;
+    delete inotify;
+#elif defined(__NT__)
+    return new filemon_rdcw_backend_t();
+#elif defined(__MAC__)
+    auto kq = new filemon_kqueue_backend_t();
+    if (kq->ok())
+        return kq;
+    delete kq;
+#endif
+    return new filemon_poll_backend_t();
+}
+
+//-------------------------------------------------------------------------
+// Watches a set of files through a backend and accumulates their changes
+class filemon_t
+{
+    std::unique_ptr<filemon_backend_t> backend;
+
+    // A watched directory and the watched files in it
+    struct watched_dir_t
+    {
+        qstring dir;
+        qstrvec_t files;
+
+        // The path ids of the files in the metadata cache
+        qvector<uint32> ids;
+
+        bool operator==(const watched_dir_t &rhs) const
+        {
+            return dir == rhs.dir && files == rhs.files;
+        }
+    };
+    // Directory key to watched directory
+    std::map<std::string, watched_dir_t> watched;
+
+    filemon_changes_t changes;
+    bool b_rescan = true;
+
+    // The metadata of the watched files for the current scan
+    file_stat_cache_t stats;
+
+    // Registers all the watched directories with the backend
+    void rewatch()
+    {
+        backend->clear();
+        for (auto &kv: watched)
+        {
+            if (!backend->add_dir(kv.second.dir.c_str(), kv.second.files))
+            {
+                if (!backend->is_polling())
+                {
+                    msg("QScripts: cannot watch '%s' with %s, falling back to polling\n",
+                        kv.second.dir.c_str(),
+                        backend->name());
+                    backend.reset(new filemon_poll_backend_t());
+                }
+                break;
+            }
+        }
+    }
+
+public:
+    filemon_t(): backend(create_filemon_backend())
+    {
+    }
+
+    bool is_polling() const { return backend->is_polling(); }
+
+    int event_fd() const { return backend->event_fd(); }
+    bool has_lost_dirs() const { return backend->has_lost_dirs(); }
+
+    // Switches to another backend for the current watch set
+    void set_backend(filemon_backend_t *new_backend)
+    {
+        backend.reset(new_backend);
+        changes.clear();
+        rewatch();
+        b_rescan = true;
+    }
+
+    // Switches to the polling backend for the current watch set
+    void use_polling()
+    {
+        if (!backend->is_polling())
+            set_backend(new filemon_poll_backend_t());
+    }
+
+    // Sets the list of files to watch
+    void watch(const qstrvec_t &files)
+    {
+        std::map<std::string, watched_dir_t> new_watched;
+        qstring dir;
+        for (auto &file: files)
+        {
+            if (file.empty())
+                continue;
+
+            dir.resize(file.size());
+            qdirname(dir.begin(), dir.size(), file.c_str());
+            dir.resize(strlen(dir.c_str()));
+
+            auto &wd = new_watched[filemon_key(dir.c_str())];
+            if (wd.dir.empty())
+                wd.dir = dir;
+            if (wd.files.add_unique(file))
+                wd.ids.push_back(stats.add(file.c_str()));
+        }
+
+        // Same watch set?
+        if (new_watched == watched)
+            return;
+
+        watched = std::move(new_watched);
+        rewatch();
+
+        // Changes may have happened before the watches were in place
+        b_rescan = true;
+    }
+
+    void unwatch()
+    {
+        watched.clear();
+        backend->clear();
+        changes.clear();
+        stats.clear();
+        b_rescan = true;
+    }
+
+    // Drains the backend. Returns true if any of the watched files may have changed.
+    bool poll()
+    {
+        if (!backend->drain(changes))
+        {
+            // Events were lost or a watched directory went away
+            b_rescan = true;
+            if (!backend->is_polling())
+                rewatch();
+        }
+        return b_rescan || !changes.empty();
+    }
+
+    // Was the file reported as changed since the last call to done()?
+    bool is_changed(const char *path) const
+    {
+        return b_rescan || changes.find(filemon_key(path)) != changes.end();
+    }
+    bool is_changed(const qstring &path) const
+    {
+        return is_changed(path.c_str());
+    }
+
+    // Returns the metadata of the watched files for the changes returned by poll().
+    // On a full rescan, the watched files are read one directory at a time: a single listing
+    // per directory on MS Windows, still one stat per file elsewhere (see stat_dir()).
+    // Otherwise, only the reported files are read, on demand.
+    file_stat_cache_t &scan()
+    {
+        stats.new_scan();
+        if (b_rescan)
+        {
+            for (auto &kv: watched)
+                stats.stat_dir(kv.second.dir.c_str(), kv.second.ids);
+        }
+        return stats;
+    }
+
+    // Forces all the watched files to be checked on the next poll
+    void request_rescan()
+    {
+        b_rescan = true;
+    }
+
+    // Done handling the current changes
+    void done()
+    {
+        changes.clear();
+        b_rescan = false;
+    }
+};
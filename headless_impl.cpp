@@ -0,0 +1,125 @@
+//-------------------------------------------------------------------------
+// Headless mode
+//
+// Under idat (for example 'idat -A'), QScripts can execute a script and optionally keep
+// watching its dependencies, without the scripts chooser. The mode is configured with the
+// plugin options:
+//
+//      -Oqscripts:script=<path>;deps=<index file>;mode=once|watch;timeout=<seconds>
+//
+// or, for the options that are not given, with the QSCRIPTS_HEADLESS_SCRIPT,
+// QSCRIPTS_HEADLESS_DEPS, QSCRIPTS_HEADLESS_MODE and QSCRIPTS_HEADLESS_TIMEOUT environment
+// variables. The environment variables are inherited by the child processes: they are only
+// used by the text mode IDA (idat), never by the GUI. IDA exits with the status of the last
+// run once done.
+
+// The exit codes of the headless mode
+enum headless_status_e
+{
+    HEADLESS_OK          = 0,
+    HEADLESS_RUN_FAILED  = 1,
+    HEADLESS_BAD_OPTIONS = 2,
+};
+
+struct headless_opts_t
+{
+    // The root script
+    qstring script_file;
+
+    // Overrides the root script's index file
+    qstring deps_file;
+
+    // Keep watching the dependencies after the first run
+    bool b_watch = false;
+
+    // Watch mode: stop after this many seconds (0 watches until IDA is closed)
+    int timeout_secs = 0;
+
+    // Options parsing errors
+    qstring error;
+
+    bool is_enabled() const
+    {
+        return !script_file.empty();
+    }
+
+    bool set(const char *key, const char *value)
+    {
+        if (streq(key, "script"))
+        {
+            script_file = value;
+        }
+        else if (streq(key, "deps"))
+        {
+            deps_file = value;
+        }
+        else if (streq(key, "mode"))
+        {
+            if (streq(value, "watch"))
+                b_watch = true;
+            else if (streq(value, "once"))
+                b_watch = false;
+            else
+                return false;
+        }
+        else if (streq(key, "timeout"))
+        {
+            char *end;
+            timeout_secs = int(strtol(value, &end, 10));
+            if (*value == '\0' || *end != '\0' || timeout_secs < 0)
+                return false;
+        }
+        else
+        {
+            return false;
+        }
+        return true;
+    }
+
+    // Reads the environment variables (if 'b_use_env') then the plugin options.
+    // Returns true if the headless mode is enabled.
+    bool load(const char *plugin_options, bool b_use_env)
+    {
+        static const char *const env_opts[][2] =
+        {
+            { "QSCRIPTS_HEADLESS_SCRIPT",  "script" },
+            { "QSCRIPTS_HEADLESS_DEPS",    "deps" },
+            { "QSCRIPTS_HEADLESS_MODE",    "mode" },
+            { "QSCRIPTS_HEADLESS_TIMEOUT", "timeout" },
+        };
+        for (auto &env_opt: env_opts)
+        {
+            qstring value;
+            if (!b_use_env)
+                break;
+            if (qgetenv(env_opt[0], &value) && !set(env_opt[1], value.c_str()))
+                error.cat_sprnt("invalid value '%s' for %s\n", value.c_str(), env_opt[0]);
+        }
+
+        for (const char *p = plugin_options == nullptr ? "" : plugin_options; *p != '\0'; )
+        {
+            const char *end = strchr(p, ';');
+            if (end == nullptr)
+                end = p + strlen(p);
+
+            qstring opt(p, end - p);
+            p = *end == '\0' ? end : end + 1;
+            if (opt.empty())
+                continue;
+
+            qstring key = opt, value;
+            const char *eq = strchr(opt.c_str(), '=');
+            if (eq != nullptr)
+            {
+                key = qstring(opt.c_str(), eq - opt.c_str());
+                value = eq + 1;
+            }
+            if (!set(key.c_str(), value.c_str()))
+                error.cat_sprnt("invalid plugin option '%s'\n", opt.c_str());
+        }
+
+        if (!error.empty() && script_file.empty())
+            error.append("no script given\n");
+        return is_enabled() || !error.empty();
+    }
+};
@@ -0,0 +1,724 @@
+//-------------------------------------------------------------------------
+// Remote trigger channel
+//
+// A local endpoint (a Unix domain socket, or a named pipe on MS Windows) that editors and
+// build tools connect to instead of creating trigger files. The protocol is line based:
+// each command line gets a single reply line ("ok ..." or "error ..."). Other lines
+// (the run results) may be sent to the connected clients at any time.
+// The commands are handled on the channel's own threads.
+
+class ipc_server_t
+{
+public:
+    // Handles a command line of a client and fills its reply line (without the new line).
+    // An empty reply sends nothing back.
+    using handler_t = std::function<void(uint32 client, const qstring &command, qstring &reply)>;
+
+    // Called once a client is disconnected
+    using closed_handler_t = std::function<void(uint32 client)>;
+
+private:
+    static constexpr size_t MAX_LINE = 64 * 1024;
+
+    qstring m_endpoint;
+    handler_t m_handler;
+    closed_handler_t m_closed_handler;
+    std::thread m_thread;
+    std::atomic<bool> m_b_stop{false};
+    std::mutex m_mutex;
+
+#if defined(__NT__)
+    HANDLE m_stop_event = nullptr;
+
+    // The first instance of the pipe, created when the server starts
+    HANDLE m_first_pipe = INVALID_HANDLE_VALUE;
+
+    // A connected client, served on its own thread
+    struct pipe_client_t
+    {
+        uint32 id = 0;
+        HANDLE pipe = INVALID_HANDLE_VALUE;
+
+        // Lines sent to the client by the other threads (guarded by m_mutex)
+        HANDLE send_event = nullptr;
+        qstrvec_t outgoing;
+
+        std::thread thread;
+        std::atomic<bool> b_done{false};
+    };
+    // The connected clients (guarded by m_mutex)
+    std::list<std::unique_ptr<pipe_client_t>> m_clients;
+    uint32 m_next_client = 0;
+
+    HANDLE create_pipe(bool b_first)
+    {
+        return CreateNamedPipeA(
+            m_endpoint.c_str(),
+            PIPE_ACCESS_DUPLEX | FILE_FLAG_OVERLAPPED | (b_first ? FILE_FLAG_FIRST_PIPE_INSTANCE : 0),
+            PIPE_TYPE_BYTE | PIPE_READMODE_BYTE | PIPE_WAIT | PIPE_REJECT_REMOTE_CLIENTS,
+            PIPE_UNLIMITED_INSTANCES, 64 * 1024, 64 * 1024, 0, nullptr);
+    }
+
+    // Writes to a client, giving up if the server stops first
+    bool write_all(HANDLE pipe, HANDLE io_event, const qstring &data)
+    {
+        OVERLAPPED ov = {};
+        ov.hEvent = io_event;
+        DWORD written = 0;
+        if (!WriteFile(pipe, data.c_str(), DWORD(data.length()), nullptr, &ov) && GetLastError() != ERROR_IO_PENDING)
+            return false;
+
+        HANDLE events[] = { io_event, m_stop_event };
+        if (WaitForMultipleObjects(qnumber(events), events, FALSE, INFINITE) != WAIT_OBJECT_0)
+        {
+            CancelIo(pipe);
+            GetOverlappedResult(pipe, &ov, &written, TRUE);
+            return false;
+        }
+        return GetOverlappedResult(pipe, &ov, &written, FALSE) && written == data.length();
+    }
+
+    // Serves a connected client until it disconnects or the server stops
+    void serve_client(pipe_client_t *client)
+    {
+        HANDLE pipe        = client->pipe;
+        HANDLE read_event  = CreateEventA(nullptr, TRUE, FALSE, nullptr);
+        HANDLE write_event = CreateEventA(nullptr, TRUE, FALSE, nullptr);
+
+        qstring pending;
+        char buf[4096];
+        bool b_connected = true;
+        while (b_connected && !m_b_stop)
+        {
+            OVERLAPPED ov = {};
+            ov.hEvent = read_event;
+            if (!ReadFile(pipe, buf, sizeof(buf), nullptr, &ov) && GetLastError() != ERROR_IO_PENDING)
+                break;
+
+            // Send the queued lines while waiting for the client
+            while (true)
+            {
+                HANDLE events[] = { read_event, m_stop_event, client->send_event };
+                DWORD r = WaitForMultipleObjects(qnumber(events), events, FALSE, INFINITE);
+                if (r == WAIT_OBJECT_0 + 2)
+                {
+                    qstrvec_t lines;
+                    {
+                        std::lock_guard<std::mutex> lock(m_mutex);
+                        lines.swap(client->outgoing);
+                    }
+                    for (auto &line: lines)
+                        b_connected = b_connected && write_all(pipe, write_event, line);
+                    if (b_connected)
+                        continue;
+                }
+                if (r != WAIT_OBJECT_0 || !b_connected)
+                {
+                    CancelIo(pipe);
+                    GetOverlappedResult(pipe, &ov, &r, TRUE);
+                    b_connected = false;
+                }
+                break;
+            }
+            if (!b_connected)
+                break;
+
+            DWORD nread = 0;
+            if (!GetOverlappedResult(pipe, &ov, &nread, FALSE) || nread == 0)
+                break;
+
+            pending.append(buf, nread);
+            qstring replies;
+            if (     !process_lines(client->id, pending, replies)
+                 || (!replies.empty() && !write_all(pipe, write_event, replies)))
+            {
+                break;
+            }
+        }
+
+        CloseHandle(read_event);
+        CloseHandle(write_event);
+        DisconnectNamedPipe(pipe);
+        if (m_closed_handler)
+            m_closed_handler(client->id);
+        client->b_done = true;
+    }
+
+    // Joins the threads of the disconnected clients
+    void reap_clients(bool b_all)
+    {
+        std::list<std::unique_ptr<pipe_client_t>> done;
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            for (auto p = m_clients.begin(); p != m_clients.end(); )
+            {
+                auto cur = p++;
+                if (b_all || (*cur)->b_done)
+                    done.splice(done.end(), m_clients, cur);
+            }
+        }
+        for (auto &client: done)
+        {
+            if (client->thread.joinable())
+                client->thread.join();
+            CloseHandle(client->pipe);
+            CloseHandle(client->send_event);
+        }
+    }
+
+    // Waits for the clients, each one on a new instance of the pipe
+    void thread_proc()
+    {
+        HANDLE connect_event = CreateEventA(nullptr, TRUE, FALSE, nullptr);
+        HANDLE pipe = m_first_pipe;
+        m_first_pipe = INVALID_HANDLE_VALUE;
+        while (!m_b_stop && pipe != INVALID_HANDLE_VALUE)
+        {
+            OVERLAPPED ov = {};
+            ov.hEvent = connect_event;
+            bool b_connected = ConnectNamedPipe(pipe, &ov) != FALSE;
+            if (!b_connected)
+            {
+                DWORD err = GetLastError();
+                if (err == ERROR_PIPE_CONNECTED)
+                {
+                    b_connected = true;
+                }
+                else if (err == ERROR_IO_PENDING)
+                {
+                    HANDLE events[] = { connect_event, m_stop_event };
+                    DWORD n;
+                    if (WaitForMultipleObjects(qnumber(events), events, FALSE, INFINITE) == WAIT_OBJECT_0)
+                    {
+                        b_connected = GetOverlappedResult(pipe, &ov, &n, FALSE) != FALSE;
+                    }
+                    else
+                    {
+                        CancelIo(pipe);
+                        GetOverlappedResult(pipe, &ov, &n, TRUE);
+                    }
+                }
+            }
+
+            reap_clients(false);
+            if (!b_connected)
+            {
+                DisconnectNamedPipe(pipe);
+                CloseHandle(pipe);
+            }
+            else
+            {
+                auto client = std::make_unique<pipe_client_t>();
+                client->pipe = pipe;
+                client->send_event = CreateEventA(nullptr, FALSE, FALSE, nullptr);
+
+                std::lock_guard<std::mutex> lock(m_mutex);
+                client->id = ++m_next_client;
+                try
+                {
+                    client->thread = std::thread(&ipc_server_t::serve_client, this, client.get());
+                    m_clients.push_back(std::move(client));
+                }
+                catch (const std::system_error &)
+                {
+                    DisconnectNamedPipe(pipe);
+                    CloseHandle(pipe);
+                    CloseHandle(client->send_event);
+                }
+            }
+            pipe = m_b_stop ? INVALID_HANDLE_VALUE : create_pipe(false);
+        }
+        if (pipe != INVALID_HANDLE_VALUE)
+            CloseHandle(pipe);
+        CloseHandle(connect_event);
+    }
+#else
+    int m_listen_fd = -1;
+
+    // The socket file is ours to remove
+    bool m_b_bound = false;
+
+    // The connected clients (guarded by m_mutex)
+    qvector<int> m_clients;
+
+    static bool write_all(int fd, const qstring &data)
+    {
+#   if defined(MSG_NOSIGNAL)
+        const int flags = MSG_NOSIGNAL;
+#   else
+        const int flags = 0;
+#   endif
+        // The client sockets do not block: a client that does not read its replies is dropped
+        return send(fd, data.c_str(), data.length(), flags) == ssize_t(data.length());
+    }
+
+    void close_client(int fd)
+    {
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            auto p = m_clients.find(fd);
+            if (p != m_clients.end())
+                m_clients.erase(p);
+            close(fd);
+        }
+        if (m_closed_handler)
+            m_closed_handler(uint32(fd));
+    }
+
+    void thread_proc()
+    {
+        // The pending input of each client
+        std::unordered_map<int, qstring> pending;
+        while (!m_b_stop)
+        {
+            qvector<pollfd> fds;
+            fds.push_back({ m_listen_fd, POLLIN, 0 });
+            {
+                std::lock_guard<std::mutex> lock(m_mutex);
+                for (auto fd: m_clients)
+                    fds.push_back({ fd, POLLIN, 0 });
+            }
+
+            // Wake up regularly to check for the stop request
+            if (poll(fds.begin(), fds.size(), 200) <= 0)
+                continue;
+
+            if ((fds[0].revents & POLLIN) != 0)
+            {
+                int fd = accept(m_listen_fd, nullptr, nullptr);
+                if (fd >= 0)
+                {
+                    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+#   if defined(SO_NOSIGPIPE)
+                    int on = 1;
+                    setsockopt(fd, SOL_SOCKET, SO_NOSIGPIPE, &on, sizeof(on));
+#   endif
+                    std::lock_guard<std::mutex> lock(m_mutex);
+                    m_clients.push_back(fd);
+                }
+            }
+
+            for (size_t i = 1; i < fds.size(); ++i)
+            {
+                if (fds[i].revents == 0)
+                    continue;
+
+                int fd = fds[i].fd;
+                char buf[4096];
+                ssize_t nread = read(fd, buf, sizeof(buf));
+                if (nread < 0 && (errno == EAGAIN || errno == EINTR))
+                    continue;
+
+                bool b_ok = nread > 0;
+                if (b_ok)
+                {
+                    auto &input = pending[fd];
+                    input.append(buf, size_t(nread));
+                    qstring replies;
+                    b_ok = process_lines(uint32(fd), input, replies) && (replies.empty() || write_all(fd, replies));
+                }
+                if (!b_ok)
+                {
+                    pending.erase(fd);
+                    close_client(fd);
+                }
+            }
+        }
+    }
+#endif
+
+    // Handles the complete command lines of a client input and returns their replies.
+    // Fails if the client sends overlong lines.
+    bool process_lines(uint32 client, qstring &input, qstring &replies)
+    {
+        size_t start = 0;
+        for (const char *nl; (nl = strchr(input.c_str() + start, '\n')) != nullptr; )
+        {
+            size_t end = nl - input.c_str();
+            qstring command(input.c_str() + start, end - start);
+            start = end + 1;
+
+            command.trim2();
+            if (command.empty())
+                continue;
+
+            qstring reply;
+            m_handler(client, command, reply);
+            if (reply.empty())
+                continue;
+            replies.append(reply);
+            replies.append('\n');
+        }
+        input.remove(0, start);
+        return input.length() < MAX_LINE;
+    }
+
+public:
+    // The endpoint used when none is configured: one per IDA instance
+    static void get_default_endpoint(qstring &endpoint)
+    {
+#if defined(__NT__)
+        endpoint.sprnt("\\\\.\\pipe\\qscripts.%u", uint32(GetCurrentProcessId()));
+#else
+        endpoint.sprnt("%s" SDIRCHAR "qscripts.%u.sock", get_user_idadir(), uint32(getpid()));
+#endif
+    }
+
+    const qstring &endpoint() const { return m_endpoint; }
+
+#if !defined(__NT__)
+    // Removes a socket file that nobody listens on anymore. The path can be set by the user:
+    // anything else than a socket, or a socket still served by another instance, is kept.
+    static bool remove_stale_socket(const char *path)
+    {
+        struct stat st;
+        if (lstat(path, &st) != 0 || !S_ISSOCK(st.st_mode))
+            return false;
+
+        sockaddr_un addr = {};
+        addr.sun_family = AF_UNIX;
+        if (strlen(path) >= sizeof(addr.sun_path))
+            return false;
+        qstrncpy(addr.sun_path, path, sizeof(addr.sun_path));
+
+        int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (fd < 0)
+            return false;
+        bool b_stale = connect(fd, (const sockaddr *)&addr, sizeof(addr)) != 0 && errno == ECONNREFUSED;
+        close(fd);
+        return b_stale && unlink(path) == 0;
+    }
+#endif
+
+    bool is_running() const { return m_thread.joinable(); }
+
+    // Starts listening on the endpoint. Fails if another server already listens on it.
+    // A socket file left behind is removed first, unless 'b_keep_existing' is set: the
+    // caller then checks by itself that nothing listens on it anymore.
+    bool start(
+        const char *endpoint,
+        handler_t handler,
+        qstring &err,
+        closed_handler_t closed_handler = nullptr,
+        bool b_keep_existing = false)
+    {
+        stop();
+        m_endpoint       = endpoint;
+        m_handler        = std::move(handler);
+        m_closed_handler = std::move(closed_handler);
+        m_b_stop         = false;
+
+#if defined(__NT__)
+        qnotused(b_keep_existing);
+        m_stop_event = CreateEventA(nullptr, TRUE, FALSE, nullptr);
+        m_first_pipe = create_pipe(true);
+        if (m_first_pipe == INVALID_HANDLE_VALUE)
+        {
+            err.sprnt("cannot listen on '%s' (error %u)", endpoint, uint32(GetLastError()));
+            stop();
+            return false;
+        }
+#else
+        sockaddr_un addr = {};
+        addr.sun_family = AF_UNIX;
+        if (m_endpoint.length() >= sizeof(addr.sun_path))
+        {
+            err.sprnt("the socket path '%s' is too long", endpoint);
+            return false;
+        }
+        qstrncpy(addr.sun_path, endpoint, sizeof(addr.sun_path));
+
+        // A previous instance may have left its socket behind
+        if (!b_keep_existing)
+            remove_stale_socket(endpoint);
+        m_listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        bool b_ok = m_listen_fd >= 0 && bind(m_listen_fd, (const sockaddr *)&addr, sizeof(addr)) == 0;
+        m_b_bound = b_ok;
+
+        // The commands run code in IDA: only the user may connect (before anyone can)
+        b_ok = b_ok && chmod(endpoint, S_IRUSR | S_IWUSR) == 0 && listen(m_listen_fd, SOMAXCONN) == 0;
+        if (!b_ok)
+        {
+            err.sprnt("cannot listen on '%s': %s", endpoint, strerror(errno));
+            stop();
+            return false;
+        }
+#endif
+        try
+        {
+            m_thread = std::thread(&ipc_server_t::thread_proc, this);
+        }
+        catch (const std::system_error &)
+        {
+            err = "cannot start the channel thread";
+            stop();
+            return false;
+        }
+        return true;
+    }
+
+    // Sends a line to all the connected clients
+    void send_all(const qstring &line)
+    {
+        qstring data = line;
+        data.append('\n');
+        std::lock_guard<std::mutex> lock(m_mutex);
+#if defined(__NT__)
+        for (auto &client: m_clients)
+        {
+            if (!client->b_done)
+            {
+                client->outgoing.push_back(data);
+                SetEvent(client->send_event);
+            }
+        }
+#else
+        // A failed client is shut down: the channel thread then sees it disconnected
+        for (auto fd: m_clients)
+        {
+            if (!write_all(fd, data))
+                shutdown(fd, SHUT_RDWR);
+        }
+#endif
+    }
+
+    void stop()
+    {
+        m_b_stop = true;
+#if defined(__NT__)
+        if (m_stop_event != nullptr)
+            SetEvent(m_stop_event);
+#endif
+        if (m_thread.joinable())
+            m_thread.join();
+
+#if defined(__NT__)
+        reap_clients(true);
+        if (m_first_pipe != INVALID_HANDLE_VALUE)
+        {
+            CloseHandle(m_first_pipe);
+            m_first_pipe = INVALID_HANDLE_VALUE;
+        }
+        if (m_stop_event != nullptr)
+        {
+            CloseHandle(m_stop_event);
+            m_stop_event = nullptr;
+        }
+#else
+        for (auto fd: m_clients)
+            close(fd);
+        m_clients.qclear();
+        if (m_listen_fd >= 0)
+        {
+            close(m_listen_fd);
+            m_listen_fd = -1;
+        }
+        if (m_b_bound)
+        {
+            unlink(m_endpoint.c_str());
+            m_b_bound = false;
+        }
+#endif
+    }
+
+    ~ipc_server_t()
+    {
+        stop();
+    }
+};
+
+//-------------------------------------------------------------------------
+// A client of a channel endpoint. Not thread safe: meant to be used from a single thread.
+class ipc_client_t
+{
+#if defined(__NT__)
+    HANDLE m_pipe = INVALID_HANDLE_VALUE;
+#else
+    int m_fd = -1;
+#endif
+    qstring m_pending;
+
+public:
+#if !defined(__NT__)
+    // Readable when lines were received or the server went away
+    int get_fd() const { return m_fd; }
+#endif
+
+    bool is_connected() const
+    {
+#if defined(__NT__)
+        return m_pipe != INVALID_HANDLE_VALUE;
+#else
+        return m_fd >= 0;
+#endif
+    }
+
+    // Connects to a server. Fails with 'b_no_server' set if nothing listens on the endpoint.
+    bool connect(const char *endpoint, bool *b_no_server, qstring &err)
+    {
+        close();
+        *b_no_server = false;
+#if defined(__NT__)
+        for (int attempt = 0; attempt < 4; ++attempt)
+        {
+            m_pipe = CreateFileA(endpoint, GENERIC_READ | GENERIC_WRITE, 0, nullptr, OPEN_EXISTING, 0, nullptr);
+            if (m_pipe != INVALID_HANDLE_VALUE)
+                return true;
+
+            // All the instances of the pipe are taken: the server creates a new one shortly
+            DWORD last_err = GetLastError();
+            if (last_err != ERROR_PIPE_BUSY)
+            {
+                *b_no_server = last_err == ERROR_FILE_NOT_FOUND;
+                err.sprnt("cannot connect to '%s' (error %u)", endpoint, uint32(last_err));
+                return false;
+            }
+            WaitNamedPipeA(endpoint, 500);
+        }
+        err.sprnt("cannot connect to '%s': the server is busy", endpoint);
+        return false;
+#else
+        sockaddr_un addr = {};
+        addr.sun_family = AF_UNIX;
+        if (strlen(endpoint) >= sizeof(addr.sun_path))
+        {
+            err.sprnt("the socket path '%s' is too long", endpoint);
+            return false;
+        }
+        qstrncpy(addr.sun_path, endpoint, sizeof(addr.sun_path));
+
+        m_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (m_fd < 0 || ::connect(m_fd, (const sockaddr *)&addr, sizeof(addr)) != 0)
+        {
+            *b_no_server = errno == ENOENT || errno == ECONNREFUSED;
+            err.sprnt("cannot connect to '%s': %s", endpoint, strerror(errno));
+            close();
+            return false;
+        }
+        fcntl(m_fd, F_SETFL, fcntl(m_fd, F_GETFL) | O_NONBLOCK);
+#   if defined(SO_NOSIGPIPE)
+        int on = 1;
+        setsockopt(m_fd, SOL_SOCKET, SO_NOSIGPIPE, &on, sizeof(on));
+#   endif
+        return true;
+#endif
+    }
+
+    // Sends a line to the server. Disconnects on failure.
+    bool send_line(const qstring &line)
+    {
+        if (!is_connected())
+            return false;
+
+        qstring data = line;
+        data.append('\n');
+#if defined(__NT__)
+        DWORD written = 0;
+        bool b_ok = WriteFile(m_pipe, data.c_str(), DWORD(data.length()), &written, nullptr) && written == data.length();
+#else
+#   if defined(MSG_NOSIGNAL)
+        const int flags = MSG_NOSIGNAL;
+#   else
+        const int flags = 0;
+#   endif
+        bool b_ok = true;
+        for (size_t off = 0; b_ok && off < data.length(); )
+        {
+            ssize_t n = send(m_fd, data.c_str() + off, data.length() - off, flags);
+            if (n > 0)
+            {
+                off += size_t(n);
+                continue;
+            }
+
+            // The server is slow to read: wait a bit for room
+            pollfd pfd = { m_fd, POLLOUT, 0 };
+            b_ok = n < 0 && (errno == EAGAIN || errno == EINTR) && poll(&pfd, 1, 1000) > 0;
+        }
+#endif
+        if (!b_ok)
+            close();
+        return b_ok;
+    }
+
+    // Reads the complete lines received so far, without blocking.
+    // Returns false (and disconnects) if the server went away.
+    bool read_lines(qstrvec_t &lines)
+    {
+        if (!is_connected())
+            return false;
+
+        char buf[4096];
+        bool b_ok = true;
+        while (true)
+        {
+#if defined(__NT__)
+            DWORD avail = 0, nread = 0;
+            if (!PeekNamedPipe(m_pipe, nullptr, 0, nullptr, &avail, nullptr))
+            {
+                b_ok = false;
+                break;
+            }
+            if (avail == 0)
+                break;
+            if (!ReadFile(m_pipe, buf, qmin(avail, DWORD(sizeof(buf))), &nread, nullptr) || nread == 0)
+            {
+                b_ok = false;
+                break;
+            }
+#else
+            ssize_t nread = read(m_fd, buf, sizeof(buf));
+            if (nread < 0 && errno == EINTR)
+                continue;
+            if (nread < 0 && errno == EAGAIN)
+                break;
+            if (nread <= 0)
+            {
+                b_ok = false;
+                break;
+            }
+#endif
+            m_pending.append(buf, size_t(nread));
+        }
+
+        size_t start = 0;
+        for (const char *nl; (nl = strchr(m_pending.c_str() + start, '\n')) != nullptr; )
+        {
+            size_t end = nl - m_pending.c_str();
+            qstring line(m_pending.c_str() + start, end - start);
+            start = end + 1;
+
+            line.trim2();
+            if (!line.empty())
+                lines.push_back(line);
+        }
+        m_pending.remove(0, start);
+
+        if (!b_ok)
+            close();
+        return b_ok;
+    }
+
+    void close()
+    {
+#if defined(__NT__)
+        if (m_pipe != INVALID_HANDLE_VALUE)
+        {
+            CloseHandle(m_pipe);
+            m_pipe = INVALID_HANDLE_VALUE;
+        }
+#else
+        if (m_fd >= 0)
+        {
+            ::close(m_fd);
+            m_fd = -1;
+        }
+#endif
+        m_pending.qclear();
+    }
+
+    ~ipc_client_t()
+    {
+        close();
+    }
+};
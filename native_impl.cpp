@@ -0,0 +1,139 @@
+//-------------------------------------------------------------------------
+// Native plugins hot-reload
+//
+// In native mode, the build output of a plugin is watched like a kept trigger file.
+// Each new build is copied to a shadow file and IDA loads the shadow file instead of
+// the build output, so the linker can always overwrite the build output even while
+// the previous build is loaded.
+// IDA has no API to unload a plugin on demand: the plugin should have the PLUGIN_UNL
+// flag so that IDA unloads it after each run. The shadow files are deleted once IDA
+// no longer has them loaded.
+
+enum class native_load_e
+{
+    ok,
+    copy_failed,    // The build output could not be read (most likely still being written)
+    load_failed,
+    run_failed,
+};
+
+class native_loader_t
+{
+    // Shadow files of the previous builds, not deleted yet
+    qstrvec_t m_shadows;
+    uint32 m_seq = 0;
+
+    static void get_shadow_dir(qstring &dir)
+    {
+        dir.sprnt("%s" SDIRCHAR "qscripts_native", get_user_idadir());
+    }
+
+    // Copies the build output to a new shadow file.
+    // A new name is used for each build: IDA would reuse a loaded module with the same path.
+    bool make_shadow(const char *binary, qstring &shadow, qstring &err)
+    {
+        namespace fs = std::filesystem;
+
+        qstring dir;
+        get_shadow_dir(dir);
+
+        std::error_code ec;
+        fs::create_directories(fs::u8path(dir.c_str()), ec);
+
+        auto src  = fs::u8path(binary);
+        auto stem = src.stem().u8string();
+        auto ext  = src.extension().u8string();
+        uint32 stamp = uint32(time(nullptr));
+        for (int attempt = 0; attempt < 16; ++attempt)
+        {
+            shadow.sprnt("%s" SDIRCHAR "%s.%x.%u%s", dir.c_str(), stem.c_str(), stamp, ++m_seq, ext.c_str());
+            if (fs::copy_file(src, fs::u8path(shadow.c_str()), fs::copy_options::none, ec))
+                return true;
+
+            // Name taken (by another IDA instance): try the next one
+            if (!fs::exists(fs::u8path(shadow.c_str())))
+                break;
+        }
+        err.sprnt("cannot copy '%s' to '%s': %s", binary, shadow.c_str(), ec.message().c_str());
+        return false;
+    }
+
+public:
+    // Deletes the shadow files that IDA no longer has loaded
+    void purge()
+    {
+        for (size_t i = m_shadows.size(); i-- != 0; )
+        {
+            if (!qfileexist(m_shadows[i].c_str()) || qunlink(m_shadows[i].c_str()) == 0)
+                m_shadows.erase(m_shadows.begin() + i);
+        }
+    }
+
+    // Loads a copy of the build output and runs it with the given argument
+    native_load_e load_and_run(const char *binary, size_t arg, qstring &err)
+    {
+        purge();
+
+        qstring shadow;
+        if (!make_shadow(binary, shadow, err))
+            return native_load_e::copy_failed;
+        m_shadows.push_back(shadow);
+
+        plugin_t *plugin = load_plugin(shadow.c_str());
+        if (plugin == nullptr)
+        {
+            err.sprnt("failed to load the plugin '%s' (copied from '%s')", shadow.c_str(), binary);
+            return native_load_e::load_failed;
+        }
+
+        if (!run_plugin(plugin, arg))
+        {
+            err.sprnt("the plugin '%s' failed to run", binary);
+            return native_load_e::run_failed;
+        }
+        return native_load_e::ok;
+    }
+
+    ~native_loader_t()
+    {
+        purge();
+    }
+};
+
+//-------------------------------------------------------------------------
+// Loader mode
+//
+// A loader is developed as a native plugin calling its own load_file() logic (see the
+// loader_template example). Instead of reopening a database for each iteration, the
+// database is reused: all its segments (and the items in them) are deleted before the
+// new build of the loader runs. Meant for scratch databases (IDA started with '-t').
+
+// The loader finds its input file in this environment variable
+static constexpr char LOADER_INPUT_ENV_NAME[] = "QSCRIPTS_LOADER_INPUT";
+
+// Deletes all the segments and the entry points of the database. Returns the number of deleted segments.
+size_t reset_loader_database()
+{
+    size_t ndeleted = 0;
+    for (int i = get_segm_qty() - 1; i >= 0; --i)
+    {
+        segment_t *seg = getnseg(i);
+        if (seg != nullptr && del_segm(seg->start_ea, SEGMOD_KILL | SEGMOD_SILENT))
+            ++ndeleted;
+    }
+
+    // The SDK cannot delete entry points: drop the netnode that holds them
+    netnode entries("$ entry points");
+    if (entries != BADNODE)
+        entries.kill();
+    inf_set_start_ea(BADADDR);
+    inf_set_start_ip(BADADDR);
+    inf_set_main(BADADDR);
+    return ndeleted;
+}
+
+// The loader mode wipes the database: only on a temporary database (IDA started with -t)
+inline bool is_temp_database()
+{
+    return is_database_flag(DBFL_TEMP);
+}
@@ -0,0 +1,293 @@
+//-------------------------------------------------------------------------
+// Execution timing
+//
+// Each run (a batch of reloads followed by the execution of the active script)
+// is timed per phase and kept in a small ring buffer of recent runs. The
+// history is shown in the scripts list and can optionally be appended to a
+// CSV log so slow dependencies can be spotted. Each run can also be reported
+// to external tools as a JSON record.
+
+// High resolution stopwatch
+struct stopwatch_t
+{
+    using clock_t = std::chrono::steady_clock;
+    clock_t::time_point start;
+
+    stopwatch_t(): start(clock_t::now()) { }
+
+    void reset()
+    {
+        start = clock_t::now();
+    }
+
+    // Microseconds since the last reset
+    uint64 elapsed_us() const
+    {
+        return uint64(std::chrono::duration_cast<std::chrono::microseconds>(clock_t::now() - start).count());
+    }
+
+    // Returns the elapsed time and resets the stopwatch
+    uint64 lap_us()
+    {
+        auto now = clock_t::now();
+        auto us = uint64(std::chrono::duration_cast<std::chrono::microseconds>(now - start).count());
+        start = now;
+        return us;
+    }
+};
+
+// The timed phases of a run
+enum class run_phase_e
+{
+    detect,     // Monitor bookkeeping: draining the file monitor and checking the time stamps
+    parse,      // Re-parsing the changed index files and expanding the reload directives
+    reload,     // Executing all the reload directives
+    unload,     // Calling the unload script function
+    compile,    // Compiling (and for most languages, running) the script
+    run,        // Calling the IDC main() function
+    count
+};
+
+static constexpr const char *const run_phase_names[size_t(run_phase_e::count)] =
+{
+    "detect", "parse", "reload", "unload", "compile", "run"
+};
+
+// Appends a JSON string literal
+inline void append_json_string(qstring &out, const char *str)
+{
+    out.append('"');
+    for (auto p = (const uchar *)str; *p != '\0'; ++p)
+    {
+        switch (*p)
+        {
+            case '"':  out.append("\\\""); break;
+            case '\\': out.append("\\\\"); break;
+            case '\n': out.append("\\n"); break;
+            case '\r': out.append("\\r"); break;
+            case '\t': out.append("\\t"); break;
+            default:
+                if (*p < 0x20)
+                    out.cat_sprnt("\\u%04x", *p);
+                else
+                    out.append(char(*p));
+                break;
+        }
+    }
+    out.append('"');
+}
+
+struct run_profile_t
+{
+    struct reload_time_t
+    {
+        qstring script_file;
+        uint64 us;
+    };
+
+    qstring script_file;
+    time_t when = 0;
+    bool b_ok = false;
+    uint64 phase_us[size_t(run_phase_e::count)] = {};
+
+    // Executed by the monitor (otherwise from the UI or by a plugin run argument)
+    bool b_monitored = false;
+
+    // The trigger file that started the run (if any)
+    qstring trigger_file;
+
+    // Why the run failed (the error of the failing reload, load or compilation)
+    qstring error;
+
+    // Time spent in each reload directive, in execution order
+    qvector<reload_time_t> reloads;
+
+    uint64 &operator[](run_phase_e phase)       { return phase_us[size_t(phase)]; }
+    uint64  operator[](run_phase_e phase) const { return phase_us[size_t(phase)]; }
+
+    uint64 total_us() const
+    {
+        uint64 total = 0;
+        for (auto us: phase_us)
+            total += us;
+        return total;
+    }
+
+    // The dependency with the slowest reload directive, if any
+    const reload_time_t *slowest_reload() const
+    {
+        const reload_time_t *slowest = nullptr;
+        for (auto &r: reloads)
+        {
+            if (slowest == nullptr || r.us > slowest->us)
+                slowest = &r;
+        }
+        return slowest;
+    }
+
+    // Formats the run as a CSV line:
+    // time,script,ok,total_ms,<phase>_ms...,reloads ("file=ms;file=ms")
+    void to_csv(qstring &out) const
+    {
+        char tbuf[32];
+        qstrftime(tbuf, sizeof(tbuf), "%Y-%m-%d %H:%M:%S", when);
+
+        out.sprnt("%s,\"%s\",%d,%.3f", tbuf, script_file.c_str(), b_ok ? 1 : 0, total_us() / 1000.0);
+        for (auto us: phase_us)
+            out.cat_sprnt(",%.3f", us / 1000.0);
+
+        out.append(",\"");
+        for (size_t i = 0; i < reloads.size(); ++i)
+            out.cat_sprnt("%s%s=%.3f", i == 0 ? "" : ";", reloads[i].script_file.c_str(), reloads[i].us / 1000.0);
+        out.append("\"\n");
+    }
+
+    // Formats the run as a single line JSON object
+    void to_json(qstring &out) const
+    {
+        char tbuf[32];
+        qstrftime(tbuf, sizeof(tbuf), "%Y-%m-%dT%H:%M:%S", when);
+
+        out = "{\"script\":";
+        append_json_string(out, script_file.c_str());
+        out.cat_sprnt(",\"time\":\"%s\",\"ok\":%s,\"source\":\"%s\",\"trigger\":",
+            tbuf, b_ok ? "true" : "false", b_monitored ? "monitor" : "manual");
+        append_json_string(out, trigger_file.c_str());
+
+        out.cat_sprnt(",\"total_ms\":%.3f,\"phases_ms\":{", total_us() / 1000.0);
+        for (size_t i = 0; i < size_t(run_phase_e::count); ++i)
+            out.cat_sprnt("%s\"%s\":%.3f", i == 0 ? "" : ",", run_phase_names[i], phase_us[i] / 1000.0);
+
+        out.append("},\"reloads\":[");
+        for (size_t i = 0; i < reloads.size(); ++i)
+        {
+            out.append(i == 0 ? "{\"script\":" : ",{\"script\":");
+            append_json_string(out, reloads[i].script_file.c_str());
+            out.cat_sprnt(",\"ms\":%.3f}", reloads[i].us / 1000.0);
+        }
+
+        out.append("],\"error\":");
+        append_json_string(out, error.c_str());
+        out.append("}");
+    }
+
+    static void csv_header(qstring &out)
+    {
+        out = "time,script,ok,total_ms";
+        for (auto name: run_phase_names)
+            out.cat_sprnt(",%s_ms", name);
+        out.append(",reloads\n");
+    }
+};
+
+//-------------------------------------------------------------------------
+// Fixed size ring buffer of the most recent runs
+class run_history_t
+{
+    static constexpr size_t MAX_RUNS = 64;
+
+    qvector<run_profile_t> m_runs;
+    size_t m_next = 0;
+
+public:
+    void add(const run_profile_t &run)
+    {
+        if (m_runs.size() < MAX_RUNS)
+        {
+            m_runs.push_back(run);
+        }
+        else
+        {
+            m_runs[m_next] = run;
+            m_next = (m_next + 1) % MAX_RUNS;
+        }
+    }
+
+    size_t size() const { return m_runs.size(); }
+
+    // Returns the i-th most recent run (0 is the latest)
+    const run_profile_t &recent(size_t i) const
+    {
+        size_t n = m_runs.size();
+        return m_runs[(m_next + n - 1 - i) % n];
+    }
+
+    // The latest run of a given script
+    const run_profile_t *last_run_of(const qstring &script_file) const
+    {
+        for (size_t i = 0; i < size(); ++i)
+        {
+            auto &run = recent(i);
+            if (run.script_file == script_file)
+                return &run;
+        }
+        return nullptr;
+    }
+
+    // The latest reload time of a given dependency script
+    const run_profile_t::reload_time_t *last_reload_of(const qstring &script_file) const
+    {
+        for (size_t i = 0; i < size(); ++i)
+        {
+            for (auto &r: recent(i).reloads)
+            {
+                if (r.script_file == script_file)
+                    return &r;
+            }
+        }
+        return nullptr;
+    }
+
+    void clear()
+    {
+        m_runs.qclear();
+        m_next = 0;
+    }
+};
+
+// Writes the result of a run to a JSON file. The file is replaced atomically:
+// a reader either sees the previous run or the complete new one.
+bool write_run_result(const char *result_file, const run_profile_t &run)
+{
+    qstring tmp_file;
+    tmp_file.sprnt("%s.tmp", result_file);
+    FILE *fp = qfopen(tmp_file.c_str(), "wb");
+    if (fp == nullptr)
+        return false;
+
+    qstring json;
+    run.to_json(json);
+    json.append('\n');
+    bool ok = qfwrite(fp, json.c_str(), json.length()) == ssize_t(json.length());
+    qfclose(fp);
+
+    std::error_code ec;
+    if (ok)
+        std::filesystem::rename(std::filesystem::u8path(tmp_file.c_str()), std::filesystem::u8path(result_file), ec);
+    if (!ok || ec)
+    {
+        qunlink(tmp_file.c_str());
+        return false;
+    }
+    return true;
+}
+
+// Appends a run to the CSV log file (the header is written when the file is created)
+bool append_run_log(const char *log_file, const run_profile_t &run)
+{
+    bool b_new = !qfileexist(log_file);
+    FILE *fp = qfopen(log_file, "a");
+    if (fp == nullptr)
+        return false;
+
+    qstring line;
+    if (b_new)
+    {
+        run_profile_t::csv_header(line);
+        qfwrite(fp, line.c_str(), line.length());
+    }
+    run.to_csv(line);
+    qfwrite(fp, line.c_str(), line.length());
+    qfclose(fp);
+    return true;
+}
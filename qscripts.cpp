@@ -7,9 +7,38 @@ scripts in your favorite editor and execute them directly in IDA.
 (c) Elias Bachaalany <elias.bachaalany@gmail.com>
 */
 #include <unordered_map>
+#include <unordered_set>
+#include <map>
+#include <list>
+#include <memory>
+#include <chrono>
+#include <mutex>
+#include <thread>
+#include <atomic>
+#include <condition_variable>
 #include <string>
-#include <regex>
+#include <string_view>
+#include <functional>
 #include <filesystem>
+#if defined(__NT__)
+#   define WIN32_LEAN_AND_MEAN
+#   define NOMINMAX
+#   include <windows.h>
+#else
+#   include <sys/stat.h>
+#   include <sys/mman.h>
+#   include <fcntl.h>
+#   include <unistd.h>
+#   include <errno.h>
+#   include <poll.h>
+#   include <sys/socket.h>
+#   include <sys/un.h>
+#   if defined(__LINUX__)
+#       include <sys/inotify.h>
+#   elif defined(__MAC__)
+#       include <sys/event.h>
+#   endif
+#endif
 #pragma warning(push)
 #pragma warning(disable: 4267 4244)
 #include <loader.hpp>
@@ -19,8 +48,17 @@ scripts in your favorite editor and execute them directly in IDA.
 #include <kernwin.hpp>
 #include <diskio.hpp>
 #include <registry.hpp>
+#include <segment.hpp>
+#include <undo.hpp>
 #pragma warning(pop)
 #include "utils_impl.cpp"
+#include "filemon_impl.cpp"
+#include "profile_impl.cpp"
+#include "native_impl.cpp"
+#include "stages_impl.cpp"
+#include "headless_impl.cpp"
+#include "ipc_impl.cpp"
+#include "watch_impl.cpp"
 #include <idax/xkernwin.hpp>
 
 //-------------------------------------------------------------------------
@@ -28,6 +66,25 @@ scripts in your favorite editor and execute them directly in IDA.
 static constexpr int  IDA_MAX_RECENT_SCRIPTS    = 512;
 static constexpr char IDAREG_RECENT_SCRIPTS[]   = "RecentScripts";
 static constexpr char UNLOAD_SCRIPT_FUNC_NAME[] = "__quick_unload_script";
+static constexpr char RUN_LOG_FILE_NAME[]       = "qscripts_runs.csv";
+static constexpr char RESULT_FILE_EXT[]         = ".result.json";
+
+// Timer interval when an event based file monitor backend is used (unless the monitor
+// can block on the backend's events), and while watched directories are missing
+static constexpr int  FILEMON_EVENT_INTERVAL    = 10;
+
+// Polling mode: the monitor interval is the fastest one, used right after a change.
+// Once nothing changed for the grace period (longer while another application, most
+// likely the editor, is in the foreground), the interval doubles up to the idle one.
+static constexpr int  FAST_POLL_GRACE           = 10000;
+static constexpr int  FOCUS_POLL_GRACE          = 300000;
+static constexpr int  MAX_IDLE_POLL_INTERVAL    = 8000;
+
+// Monitor interval while it is inactive (activating the monitor wakes it up)
+static constexpr int  INACTIVE_MONITOR_INTERVAL = 30000;
+
+// How long to wait for changed files to be completely written before executing anyway
+static constexpr int  WRITE_COMPLETE_TIMEOUT    = 10000;
 
 //-------------------------------------------------------------------------
 // File modification state
@@ -42,9 +99,17 @@ enum class filemod_status_e
 struct fileinfo_t
 {
     qstring file_path;
-    qtime64_t modified_time;
+    file_time_t modified_time;
+    uint64 file_size;
+
+    // Content hash of the last seen version of the file (valid if b_hash is set)
+    uint64 content_hash;
+    bool b_hash;
+
+    // Lookup hint in the file metadata cache
+    uint32 stat_id;
 
-    fileinfo_t(const char* file_path = nullptr): modified_time(0)
+    fileinfo_t(const char* file_path = nullptr): modified_time(0), file_size(0), content_hash(0), b_hash(false), stat_id(UINT32_MAX)
     {
         if (file_path != nullptr)
             this->file_path = file_path;
@@ -69,653 +134,3269 @@ struct fileinfo_t
     {
         file_path.clear();
         modified_time = 0;
+        file_size = 0;
+        b_hash = false;
     }
 
-    bool refresh(const char *file_path = nullptr)
+    // Takes the file's current time stamp and size (and optionally its content hash)
+    bool refresh(const char *file_path = nullptr, bool with_hash = false)
     {
         if (file_path != nullptr)
             this->file_path = file_path;
 
-        return get_file_modification_time(this->file_path, &modified_time);
+        b_hash = false;
+        if (!get_file_modification_time(this->file_path, &modified_time, &file_size))
+            return false;
+
+        if (with_hash)
+            b_hash = get_file_content_hash(this->file_path.c_str(), &content_hash);
+        return true;
     }
 
     // Checks if the current script has been modified
-    // Optionally updates the time stamp to the latest one if modified
-    filemod_status_e get_modification_status(bool update_mtime=true)
+    // Optionally updates the time stamp to the latest one if modified.
+    // With 'with_hash', a file whose time stamp changed but whose contents did not
+    // (a no-op save, a 'touch', a git checkout of identical contents) is not reported as modified.
+    // The metadata is taken from 'stats' when given, so that files shared by several active scripts are read once.
+    filemod_status_e get_modification_status(
+        bool update_mtime = true,
+        bool with_hash = false,
+        file_stat_cache_t *stats = nullptr)
     {
-        qtime64_t cur_mtime;
+        file_time_t cur_mtime = 0;
+        uint64 cur_size = 0;
         const char *script_file = this->file_path.c_str();
-        if (!get_file_modification_time(script_file, &cur_mtime))
+        bool b_exists;
+        if (stats != nullptr)
+        {
+            auto &st  = stats->get(this->file_path, &stat_id);
+            b_exists  = st.exists;
+            cur_mtime = st.mtime;
+            cur_size  = st.size;
+        }
+        else
+        {
+            b_exists = get_file_modification_time(script_file, &cur_mtime, &cur_size);
+        }
+
+        if (!b_exists)
         {
             if (update_mtime)
-                modified_time = 0;
+                invalidate();
             return filemod_status_e::not_found;
         }
 
         // Script is up to date, no need to execute it again
-        if (cur_mtime == modified_time)
+        if (cur_mtime == modified_time && cur_size == file_size)
             return filemod_status_e::not_modified;
 
+        // Only hash the contents when the time stamp or the size changed
+        uint64 cur_hash = 0;
+        bool b_cur_hash =     with_hash
+                          &&  (stats != nullptr ? stats->get_hash(this->file_path, &cur_hash, &stat_id) : get_file_content_hash(script_file, &cur_hash));
+        bool b_same     = b_cur_hash && b_hash && cur_hash == content_hash;
+
         if (update_mtime)
+        {
             modified_time = cur_mtime;
+            file_size     = cur_size;
+            content_hash  = cur_hash;
+            b_hash        = b_cur_hash;
+        }
 
-        return filemod_status_e::modified;
+        return b_same ? filemod_status_e::not_modified : filemod_status_e::modified;
     }
 
     void invalidate()
     {
         modified_time = 0;
+        b_hash = false;
+    }
+};
+
+//-------------------------------------------------------------------------
+// The directives of an index file in effect for the scripts listed after them.
+// All these scripts share the same instance.
+struct dep_directive_t
+{
+    // The reload command of the scripts and its compiled form
+    qstring reload_cmd;
+    expand_template_t reload_tpl;
+
+    // Base path if the scripts are part of a package
+    qstring pkg_base;
+
+    dep_directive_t(const qstring &reload_cmd, const qstring &pkg_base)
+        : reload_cmd(reload_cmd), reload_tpl(reload_cmd.c_str()), pkg_base(pkg_base)
+    {
     }
 };
 
+using dep_directive_ptr_t = std::shared_ptr<const dep_directive_t>;
+
 //-------------------------------------------------------------------------
 // Dependency script info
 struct script_info_t: fileinfo_t
 {
     using fileinfo_t::fileinfo_t;
 
-    // Each dependency script can have its own reload command
-    qstring reload_cmd;
+    // The directives each dependency script was listed under (if any)
+    dep_directive_ptr_t directive;
 
-    // Base path if this dependency is part of a package
-    qstring pkg_base;
+    // The index file listing this script's own dependencies (if any)
+    qstring dep_index;
+
+    const qstring &reload_cmd() const
+    {
+        static const qstring empty;
+        return directive == nullptr ? empty : directive->reload_cmd;
+    }
+
+    const qstring &pkg_base() const
+    {
+        static const qstring empty;
+        return directive == nullptr ? empty : directive->pkg_base;
+    }
+
+    const bool has_reload_directive() const { return !reload_cmd().empty(); }
 
-    const bool has_reload_directive() const { return !reload_cmd.empty(); }
+    bool same_directive(const script_info_t &rhs) const
+    {
+        return     directive == rhs.directive
+               || (reload_cmd() == rhs.reload_cmd() && pkg_base() == rhs.pkg_base());
+    }
 };
 
 // Script files
 using scripts_info_t = qvector<script_info_t>;
 
 //-------------------------------------------------------------------------
-// Active script information along with its dependencies
-struct active_script_info_t: script_info_t
+// The dependency scripts of an active script, stored contiguously and looked up
+// by path through an open addressing index of entry ids. The path is only stored
+// once, in the entry itself.
+// Inserting or erasing entries invalidates the pointers to the entries.
+class dep_table_t
 {
-    // Trigger file
-    fileinfo_t trigger_file;
-
-    // Trigger file options
-    bool b_keep_trigger_file;
+    static constexpr uint32 EMPTY_SLOT = UINT32_MAX;
 
-    // The dependencies index files. First entry is for the main script's deps
-    qvector<fileinfo_t> dep_indices;
+    scripts_info_t m_entries;
 
-    // The list of dependency scripts
-    std::unordered_map<std::string, script_info_t> dep_scripts;
+    // Entry ids. The size is a power of two and the table is kept at most half full.
+    qvector<uint32> m_slots;
 
-    // Checks to see if we have a dependency on a given file
-    const script_info_t *has_dep(const qstring &dep_file) const
+    // Returns the slot of a path's entry, or the empty slot where it would go
+    size_t find_slot(const char *path, size_t len) const
     {
-        auto p = dep_scripts.find(dep_file.c_str());
-        return p == dep_scripts.end() ? nullptr : &p->second;
-    }
+        size_t mask = m_slots.size() - 1;
+        for (size_t i = std::hash<std::string_view>()(std::string_view(path, len)) & mask; ; i = (i + 1) & mask)
+        {
+            uint32 id = m_slots[i];
+            if (id == EMPTY_SLOT)
+                return i;
 
-    // Is this trigger based or dependency based?
-    const bool trigger_based() { return !trigger_file.empty(); }
+            auto &entry_path = m_entries[id].file_path;
+            if (entry_path.length() == len && memcmp(entry_path.c_str(), path, len) == 0)
+                return i;
+        }
+    }
 
-    // If no dependency index files have been modified, return 0.
-    // Return 1 if one of them has been modified or -1 if one of them has gone missing.
-    // In both latter cases, we have to recompute our dependencies
-    filemod_status_e is_any_dep_index_modified(bool update_mtime = true)
+    void rehash(size_t nslots)
     {
-        filemod_status_e r = filemod_status_e::not_modified;
-        for (auto &dep_file: dep_indices)
+        m_slots.resize(nslots);
+        std::fill(m_slots.begin(), m_slots.end(), EMPTY_SLOT);
+        for (size_t id = 0; id < m_entries.size(); ++id)
         {
-            r = dep_file.get_modification_status(update_mtime);
-            if (r != filemod_status_e::not_modified)
-                break;
+            auto &path = m_entries[id].file_path;
+            m_slots[find_slot(path.c_str(), path.length())] = uint32(id);
         }
-        return r;
     }
 
-    bool add_dep_index(const char *dep_file)
+public:
+    size_t size() const { return m_entries.size(); }
+    bool empty() const  { return m_entries.empty(); }
+
+    script_info_t *begin()             { return m_entries.begin(); }
+    script_info_t *end()               { return m_entries.end(); }
+    const script_info_t *begin() const { return m_entries.begin(); }
+    const script_info_t *end() const   { return m_entries.end(); }
+
+    script_info_t *find(const char *path, size_t len)
     {
-        fileinfo_t fi;
-        if (!get_file_modification_time(dep_file, &fi.modified_time))
-            return false;
+        if (m_slots.empty())
+            return nullptr;
 
-        fi.file_path = dep_file;
-        dep_indices.push_back(std::move(fi));
-        return true;
+        uint32 id = m_slots[find_slot(path, len)];
+        return id == EMPTY_SLOT ? nullptr : &m_entries[id];
     }
+    script_info_t *find(const char *path)        { return find(path, strlen(path)); }
+    script_info_t *find(const qstring &path)     { return find(path.c_str(), path.length()); }
+    script_info_t *find(const std::string &path) { return find(path.c_str(), path.length()); }
 
-    active_script_info_t &operator=(const script_info_t &rhs)
+    template <typename T>
+    const script_info_t *find(const T &path) const
     {
-        if (this != &rhs)
+        return const_cast<dep_table_t *>(this)->find(path);
+    }
+
+    // Adds a script (or replaces the script with the same path)
+    script_info_t &insert(script_info_t &&script)
+    {
+        if ((m_entries.size() + 1) * 2 > m_slots.size())
+            rehash(qmax(size_t(16), m_slots.size() * 2));
+
+        size_t slot = find_slot(script.file_path.c_str(), script.file_path.length());
+        if (m_slots[slot] != EMPTY_SLOT)
         {
-            file_path     = rhs.file_path;
-            modified_time = rhs.modified_time;
+            auto &entry = m_entries[m_slots[slot]];
+            entry = std::move(script);
+            return entry;
         }
-        dep_scripts.clear();
-        dep_indices.qclear();
-        return *this;
+        m_slots[slot] = uint32(m_entries.size());
+        m_entries.push_back(std::move(script));
+        return m_entries.back();
     }
 
-    void clear() override
+    // Erases the scripts matching a predicate. Returns the number of erased scripts.
+    template <typename pred_t>
+    size_t erase_if(pred_t pred)
     {
-        script_info_t::clear();
-        dep_indices.qclear();
-        dep_scripts.clear();
-        trigger_file.clear();
-        b_keep_trigger_file = false;
-        reload_cmd.clear();
-        pkg_base.clear();
+        size_t old_size = m_entries.size();
+        m_entries.erase(std::remove_if(m_entries.begin(), m_entries.end(), pred), m_entries.end());
+        if (m_entries.size() != old_size)
+            rehash(m_slots.size());
+        return old_size - m_entries.size();
     }
 
-    void invalidate_all_scripts()
+    void clear()
     {
-        invalidate();
+        m_entries.qclear();
+        m_slots.qclear();
+    }
 
-        // Invalidate all but the index file itself
-        for (auto &kv: dep_scripts)
-            kv.second.invalidate();
+    void swap(dep_table_t &rhs)
+    {
+        m_entries.swap(rhs.m_entries);
+        m_slots.swap(rhs.m_slots);
     }
 };
 
 //-------------------------------------------------------------------------
-// Non-modal scripts chooser
-struct qscripts_chooser_t: public plugmod_t, public chooser_t
+// Dependency index file along with the dependencies it lists
+struct dep_index_t: fileinfo_t
 {
-    using chooser_t::operator delete;
-    using chooser_t::operator new;
+    using fileinfo_t::fileinfo_t;
 
-private:
-    action_manager_t am;
+    // The script owning this index file
+    qstring owner;
 
-    bool m_b_filemon_timer_active;
-    qtimer_t m_filemon_timer = nullptr;
-    const std::regex RE_EXPANDER = std::regex(R"(\$(.+?)\$)");
+    // The dependency scripts listed in this index file (in order)
+    qstrvec_t deps;
 
-    int opt_change_interval  = 500;
-    int opt_clear_log        = 0;
-    int opt_show_filename    = 0;
-    int opt_exec_unload_func = 0;
-    int opt_with_undo        = 0;
+    // The listed scripts that did not exist when the index file was parsed
+    qstrvec_t missing;
+};
 
-    active_script_info_t selected_script;
+//-------------------------------------------------------------------------
+// Changes gathered during the debounce window and executed as a single batch
+struct change_batch_t
+{
+    bool b_triggered     = false;
+    bool b_main_changed  = false;
 
-    struct expand_ctx_t
-    {
-	    // input
-        qstring script_file;
-		bool    main_file;
-		
-		// working
-        qstring base_dir;
-        qstring pkg_base;
-        qstring reload_cmd;
-    };
+    // Keys of the changed dependency index files
+    std::unordered_set<std::string> dep_indices;
 
-    inline int normalize_filemon_interval(const int change_interval) const
+    // Keys of the changed dependency scripts
+    std::unordered_set<std::string> dep_scripts;
+
+    // When the last change was seen
+    std::chrono::steady_clock::time_point last_change;
+
+    // Since when the changed files are waited for to be completely written
+    bool b_waiting_writes = false;
+    std::chrono::steady_clock::time_point wait_start;
+
+    // Time spent detecting the changes of this batch
+    uint64 detect_us = 0;
+
+    bool empty() const
     {
-        return qmax(300, change_interval);
+        return !b_triggered && !b_main_changed && dep_indices.empty() && dep_scripts.empty();
     }
 
-    const char *get_selected_script_file()
+    // Milliseconds left before the batch can be executed
+    int remaining_ms(int debounce_interval) const
     {
-        return selected_script.file_path.c_str();
+        auto elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(
+            std::chrono::steady_clock::now() - last_change).count();
+        return elapsed >= debounce_interval ? 0 : int(debounce_interval - elapsed);
     }
 
-    bool parse_deps_for_script(expand_ctx_t &ctx)
+    void clear()
     {
-        // Parse the dependency index file
-        qstring dep_file;
-        dep_file.sprnt("%s.deps.qscripts", ctx.script_file.c_str());
-        FILE *fp = qfopen(dep_file.c_str(), "r");
-        if (fp == nullptr)
-        {
-            dep_file.sprnt("%s.proj.qscripts", ctx.script_file.c_str());
-            fp = qfopen(dep_file.c_str(), "r");
-            if (fp == nullptr)
-                return false;
-        }
-
-        // Get the dependency file directory
-        ctx.base_dir.resize(dep_file.size());
-        qdirname(ctx.base_dir.begin(), ctx.base_dir.size(), dep_file.c_str());
-		ctx.base_dir.resize(strlen(ctx.base_dir.c_str()));
-
-        // Add the dependency file to the active script
-        selected_script.add_dep_index(dep_file.c_str());
-
-        static auto get_value = [](const char* str, const char* key, int key_len) -> const char *
-        {
-            if (strncmp(str, key, key_len) != 0)
-                return nullptr;
-            // Empty value?
-            if (str[key_len] == '\0')
-                return "";
-            else
-                return str + key_len + 1;
-        };
-
-        // Parse each line
-        for (qstring line = dep_file; qgetline(&line, fp) != -1;)
-        {
-            line.trim2();
-
-            // Skip comment lines (';', '//' and '#')
-            if (line.empty() || strncmp(line.c_str(), "//", 2) == 0 || line[0] == '#' || line[0] == ';')
-                continue;
+        b_triggered = b_main_changed = b_waiting_writes = false;
+        dep_indices.clear();
+        dep_scripts.clear();
+        detect_us = 0;
+    }
+};
 
-            // Parse special directives (some apply only for the main selected script)
-            if (auto val = get_value(line.c_str(), "/pkgbase", 8))
-            {
-                if (ctx.main_file)
-                {
-                    ctx.pkg_base = val;
-                    make_abs_path(ctx.pkg_base, ctx.base_dir.c_str(), true);
-                }
-                continue;
-            }
-            else if (auto val = get_value(line.c_str(), "/reload", 7))
-            {
-                if (ctx.main_file)
-                    ctx.reload_cmd = val;
-                continue;
-            }
-            else if (auto trigger_file = get_value(line.c_str(), "/triggerfile", 12))
-            {
-                if (auto keep = get_value(trigger_file, "/keep", 5))
-                {
-                    trigger_file = keep;
-                    selected_script.b_keep_trigger_file = true;
-                }
+//-------------------------------------------------------------------------
+// Active script information along with its dependencies graph.
+// Scripts point to their index file and index files to the scripts they list.
+struct active_script_info_t: script_info_t
+{
+    // Trigger file
+    fileinfo_t trigger_file;
 
-                if (ctx.main_file)
-                {
-                    selected_script.trigger_file.refresh(trigger_file);
-                    expand_file_name(selected_script.trigger_file.file_path, ctx);
-                }
-                continue;
-            }
+    // Trigger file options
+    bool b_keep_trigger_file;
 
-            // From here on, the *line* variable is an expandable string leading to a script file
-            ctx.script_file = line;
-            expand_file_name(line, ctx);
+    // Native mode: the trigger file is a plugin build output, loaded and run with 'native_arg'
+    bool b_native = false;
+    size_t native_arg = 0;
 
-            // Skip dependency scripts that (do not|no longer) exist
-            script_info_t dep_script;
-            if (!get_file_modification_time(line, &dep_script.modified_time))
-                continue;
+    // Loader mode: the input file of the loader plugin (a new input re-runs the loader too)
+    fileinfo_t loader_input;
 
-            // Add script
-            dep_script.file_path  = line.c_str();
-            dep_script.reload_cmd = ctx.reload_cmd;
-            dep_script.pkg_base   = ctx.pkg_base;
+    // Overrides the index file of the script (headless mode)
+    qstring deps_file;
 
-            selected_script.dep_scripts[line.c_str()] = std::move(dep_script);
+    // The dependencies index files
+    std::unordered_map<std::string, dep_index_t> dep_indices;
 
-            expand_ctx_t sub_ctx = ctx;
-            sub_ctx.script_file  = line;
-			sub_ctx.main_file    = false;
-            parse_deps_for_script(sub_ctx);
-        }
-        qfclose(fp);
+    // The list of dependency scripts
+    dep_table_t dep_scripts;
 
-        return true;
-    }
+    // The changes seen for this script and not executed yet
+    change_batch_t batch;
 
-    void expand_file_name(qstring &filename, const expand_ctx_t &ctx)
+    // Checks to see if we have a dependency on a given file
+    const script_info_t *has_dep(const qstring &dep_file) const
     {
-        expand_string(filename, filename, ctx);
-        make_abs_path(filename, ctx.base_dir.c_str(), true);
+        return dep_scripts.find(dep_file);
     }
 
-    void set_selected_script(script_info_t &script)
+    // Returns the graph node of a script (the active script or one of its dependencies)
+    script_info_t *find_script(const qstring &script_file)
     {
-        // Activate script
-        selected_script = script;
+        if (script_file == file_path)
+            return this;
 
-        // Recursively parse the dependencies and the index files
-        expand_ctx_t main_ctx = { script.file_path.c_str(), true };
-        parse_deps_for_script(main_ctx);
+        return dep_scripts.find(script_file);
     }
 
-    void clear_selected_script()
+    const script_info_t *find_script(const qstring &script_file) const
     {
-        selected_script.clear();
-        // ...and deactivate the monitor
-        activate_monitor(false);
+        return const_cast<active_script_info_t *>(this)->find_script(script_file);
     }
 
-    const bool has_selected_script()
+    // Is this trigger based or dependency based?
+    const bool trigger_based() { return !trigger_file.empty(); }
+
+    // Takes the files metadata, the dependencies graph and the pending changes of a copy
+    // of this script. The script's path stays untouched: the main thread may be using it.
+    void update_from(active_script_info_t &&rhs)
     {
-        return !selected_script.file_path.empty();
+        modified_time       = rhs.modified_time;
+        file_size           = rhs.file_size;
+        content_hash        = rhs.content_hash;
+        b_hash              = rhs.b_hash;
+        dep_index           = std::move(rhs.dep_index);
+        trigger_file        = std::move(rhs.trigger_file);
+        b_keep_trigger_file = rhs.b_keep_trigger_file;
+        b_native            = rhs.b_native;
+        native_arg          = rhs.native_arg;
+        loader_input        = std::move(rhs.loader_input);
+        dep_indices         = std::move(rhs.dep_indices);
+        dep_scripts         = std::move(rhs.dep_scripts);
+        batch               = std::move(rhs.batch);
     }
 
-    bool is_monitor_active() const { return m_b_filemon_timer_active; }
-
-    // Dynamic string expansion
-	// ------------------------
-    // basename                       Returns the basename of the input file
-    // env:Variable_Name              Expands the 'Variable_Name'
-    // pkgbase                        Sets the current pkgbase path
-    // pkgmodname                     Expands the file name using the pckbase into the form: 'module.submodule1.submodule2'
-    void expand_string(qstring &input, qstring &output, const expand_ctx_t& ctx)
+    // Collects the dependency index files that have been modified or have gone missing.
+    // In both cases, the dependencies of their owner scripts have to be recomputed.
+    // Only the index files reported by the file monitor are checked.
+    bool get_modified_dep_indices(
+        const filemon_t &filemon,
+        std::unordered_set<std::string> &modified,
+        bool with_hash = false,
+        file_stat_cache_t *stats = nullptr)
     {
-        output = std::regex_replace(
-            input.c_str(),
-            RE_EXPANDER,
-            [this, ctx](auto &m) -> std::string
+        bool b_modified = false;
+        for (auto &kv: dep_indices)
+        {
+            auto &dep_index = kv.second;
+            if (     filemon.is_changed(dep_index.file_path)
+                 &&  dep_index.get_modification_status(true, with_hash, stats) != filemod_status_e::not_modified)
             {
-                qstring match1 = m.str(1).c_str();
-
-                if (strncmp(match1.c_str(), "pkgmodname", 10) == 0)
-                {
-                    auto dep_file = selected_script.has_dep(ctx.script_file.c_str());
-                    qstring pkg_base = dep_file == nullptr ? selected_script.pkg_base : dep_file->pkg_base;
+                modified.insert(kv.first);
+                b_modified = true;
+            }
+        }
+        return b_modified;
+    }
 
-                    // If the script file is in the package base, then replace the path separators with '.'
-                    if (strncmp(ctx.script_file.c_str(), pkg_base.c_str(), pkg_base.length()) == 0)
-                    {
-                        qstring s = ctx.script_file.c_str() + pkg_base.length() + 1;
-                        s.replace(SDIRCHAR, ".");
-                        // Drop the extension too
-                        auto idx = s.rfind('.');
-                        if (idx != -1)
-                            s.resize(idx);
+    // Returns the scripts listed in the index file of a script
+    const qstrvec_t *get_deps(const script_info_t &script) const
+    {
+        if (script.dep_index.empty())
+            return nullptr;
 
-                        return s.c_str();
-                    }
-                    return "";
-                }
-                else if (strncmp(match1.c_str(), "pkgbase", 7) == 0)
-                {
-                    return ctx.pkg_base.c_str();
-                }
-                else if (strncmp(match1.c_str(), "basename", 8) == 0)
-                {
-                    char *basename, *ext;
-                    qstring wrk_str;
-                    get_basename_and_ext(ctx.script_file.c_str(), &basename, &ext, wrk_str);
-                    return basename;
-                }
-                else if (strncmp(match1.c_str(), "env:", 4) == 0)
-                {
-                    qstring env;
-                    if (qgetenv(match1.begin() + 4, &env))
-                        return env.c_str();
-                }
-                return m.str(1);
-            }
-        ).c_str();
+        auto p = dep_indices.find(script.dep_index.c_str());
+        return p == dep_indices.end() ? nullptr : &p->second.deps;
     }
 
-    bool execute_reload_directive(
-	    script_info_t &dep_script_file, 
-		qstring &err, 
-		bool silent=true)
+    // Computes the dependency scripts to reload given the changed ones: the changed
+    // scripts and the scripts that transitively depend on them. Each script is listed
+    // once and after all the scripts it depends on.
+    void get_reload_order(
+        const std::unordered_set<std::string> &changed,
+        qstrvec_t &order) const
     {
-        const char *script_file = dep_script_file.file_path.c_str();
+        order.qclear();
+        if (changed.empty())
+            return;
 
-        do
+        // Reverse the "depends on" edges
+        std::unordered_map<std::string, qstrvec_t> dependents;
+        for (auto &kv: dep_indices)
         {
-            auto ext = get_file_ext(script_file);
-            extlang_object_t elang(find_extlang_by_ext(ext == nullptr ? "" : ext));
-            if (elang == nullptr)
+            for (auto &dep: kv.second.deps)
+                dependents[dep.c_str()].push_back(kv.second.owner);
+        }
+
+        // Propagate the changes to the dependent scripts
+        std::unordered_set<std::string> affected;
+        qstrvec_t stack;
+        for (auto &key: changed)
+        {
+            if (dep_scripts.find(key) != nullptr && affected.insert(key).second)
+                stack.push_back(key.c_str());
+        }
+        while (!stack.empty())
+        {
+            qstring script_file = stack.back();
+            stack.pop_back();
+
+            auto p = dependents.find(script_file.c_str());
+            if (p == dependents.end())
+                continue;
+
+            for (auto &dependent: p->second)
             {
-                err.sprnt("unknown script language detected for '%s'!\n", script_file);
-                break;
+                if (dep_scripts.find(dependent) != nullptr && affected.insert(dependent.c_str()).second)
+                    stack.push_back(dependent);
             }
+        }
 
-            qstring reload_cmd;
-            expand_ctx_t ctx;
-            ctx.script_file = script_file;
-            expand_string(dep_script_file.reload_cmd, reload_cmd, ctx);
+        // Post-order walk from the active script so dependencies come first
+        std::unordered_set<std::string> visited;
+        visit_reload_order(*this, affected, visited, order);
+    }
 
-            if (!elang->eval_snippet(reload_cmd.c_str(), &err))
-                break;
+    // Collects the dependency cycles. Each cycle is the list of scripts
+    // forming it, starting and ending with the same script.
+    void get_dep_cycles(qvector<qstrvec_t> &cycles) const
+    {
+        std::unordered_map<std::string, bool> visiting;
+        qstrvec_t path;
+        visit_dep_cycles(*this, visiting, path, cycles);
+    }
+
+    // Drops the scripts and index files no longer reachable from the active script.
+    // Returns true if anything was removed.
+    bool remove_unreachable()
+    {
+        std::unordered_set<std::string> reachable_scripts, reachable_indices;
+        qstrvec_t stack;
+        stack.push_back(file_path);
+        while (!stack.empty())
+        {
+            qstring script_file = stack.back();
+            stack.pop_back();
+
+            auto script = find_script(script_file);
+            if (script == nullptr || script->dep_index.empty())
+                continue;
+
+            auto p = dep_indices.find(script->dep_index.c_str());
+            if (p == dep_indices.end() || !reachable_indices.insert(p->first).second)
+                continue;
+
+            for (auto &dep: p->second.deps)
+            {
+                if (reachable_scripts.insert(dep.c_str()).second)
+                    stack.push_back(dep);
+            }
+        }
+
+        size_t old_count = dep_scripts.size() + dep_indices.size();
+        dep_scripts.erase_if([&reachable_scripts](const script_info_t &script)
+        {
+            return reachable_scripts.find(script.file_path.c_str()) == reachable_scripts.end();
+        });
+        for (auto p = dep_indices.begin(); p != dep_indices.end(); )
+        {
+            if (reachable_indices.find(p->first) == reachable_indices.end())
+                p = dep_indices.erase(p);
+            else
+                ++p;
+        }
+        return dep_scripts.size() + dep_indices.size() != old_count;
+    }
+
+private:
+    // Post-order walk of the dependencies of 'script', with an explicit stack (the chains can be deep)
+    void visit_reload_order(
+        const script_info_t &script,
+        const std::unordered_set<std::string> &affected,
+        std::unordered_set<std::string> &visited,
+        qstrvec_t &order) const
+    {
+        // The dependencies of a script, the next one to visit and the script itself (null for the root)
+        struct frame_t
+        {
+            const qstrvec_t *deps;
+            size_t next;
+            const qstring *dep;
+        };
+        qvector<frame_t> stack;
+        stack.push_back({ get_deps(script), 0, nullptr });
+        while (!stack.empty())
+        {
+            auto &top = stack.back();
+            if (top.deps == nullptr || top.next == top.deps->size())
+            {
+                // All the dependencies of this script are listed: list it
+                const qstring *dep = top.dep;
+                stack.pop_back();
+                if (dep != nullptr && affected.find(dep->c_str()) != affected.end())
+                    order.push_back(*dep);
+                continue;
+            }
+
+            auto &dep = (*top.deps)[top.next++];
+            auto dep_script = dep_scripts.find(dep);
+            if (dep_script == nullptr || !visited.insert(dep.c_str()).second)
+                continue;
+
+            stack.push_back({ get_deps(*dep_script), 0, &dep });
+        }
+    }
+
+    // 'visiting' is true for the scripts on the current path and false for the visited ones.
+    // The walk uses an explicit stack (the chains can be deep).
+    void visit_dep_cycles(
+        const script_info_t &script,
+        std::unordered_map<std::string, bool> &visiting,
+        qstrvec_t &path,
+        qvector<qstrvec_t> &cycles) const
+    {
+        // A script on the current path, its dependencies and the next one to visit
+        struct frame_t
+        {
+            const script_info_t *script;
+            const qstrvec_t *deps;
+            size_t next;
+        };
+        qvector<frame_t> stack;
+        auto enter = [&](const script_info_t &s)
+        {
+            visiting[s.file_path.c_str()] = true;
+            path.push_back(s.file_path);
+            stack.push_back({ &s, get_deps(s), 0 });
+        };
+
+        enter(script);
+        while (!stack.empty())
+        {
+            auto &top = stack.back();
+            if (top.deps == nullptr || top.next == top.deps->size())
+            {
+                path.pop_back();
+                visiting[top.script->file_path.c_str()] = false;
+                stack.pop_back();
+                continue;
+            }
+
+            auto &dep = (*top.deps)[top.next++];
+            auto p = visiting.find(dep.c_str());
+            if (p == visiting.end())
+            {
+                if (auto dep_script = find_script(dep))
+                    enter(*dep_script);
+            }
+            else if (p->second)
+            {
+                // Back edge: the cycle goes from 'dep' on the current path to here
+                auto &cycle = cycles.push_back();
+                cycle.insert(cycle.end(), std::find(path.begin(), path.end(), dep), path.end());
+                cycle.push_back(dep);
+            }
+        }
+    }
+
+    static constexpr uint32 CACHE_MAGIC   = 0x43445351; // 'QSDC'
+    static constexpr uint32 CACHE_VERSION = 4;
+
+    static void save_fileinfo(bin_writer_t &w, const fileinfo_t &fi)
+    {
+        w.str(fi.file_path);
+        w.u64(fi.modified_time);
+        w.u64(fi.file_size);
+        w.u64(fi.content_hash);
+        w.u8(fi.b_hash ? 1 : 0);
+    }
+
+    static bool load_fileinfo(bin_reader_t &r, fileinfo_t &fi)
+    {
+        r.str(fi.file_path);
+        fi.modified_time = r.u64();
+        fi.file_size     = r.u64();
+        fi.content_hash  = r.u64();
+        fi.b_hash        = r.u8() != 0;
+        return r.ok;
+    }
+
+    // The index file the parser would pick for a script now (empty if none)
+    static void find_index_file(const qstring &script_file, qstring &index_file)
+    {
+        index_file.sprnt("%s.deps.qscripts", script_file.c_str());
+        if (qfileexist(index_file.c_str()))
+            return;
+        index_file.sprnt("%s.proj.qscripts", script_file.c_str());
+        if (!qfileexist(index_file.c_str()))
+            index_file.qclear();
+    }
+
+public:
+    // Saves the resolved dependencies graph to a cache file.
+    // The graph only depends on the files it lists: the index files (time stamps and sizes),
+    // the scripts that have or not an index file and the listed scripts that were missing.
+    bool save_cache(const char *cache_file) const
+    {
+        bin_writer_t w;
+        w.u32(CACHE_MAGIC);
+        w.u32(CACHE_VERSION);
+        w.str(file_path);
+        w.str(dep_index);
+        w.str(trigger_file.file_path);
+        w.u8(b_keep_trigger_file ? 1 : 0);
+        w.u8(b_native ? 1 : 0);
+        w.u64(native_arg);
+        w.str(loader_input.file_path);
+
+        w.u32(uint32(dep_indices.size()));
+        for (auto &kv: dep_indices)
+        {
+            auto &index = kv.second;
+            save_fileinfo(w, index);
+            w.str(index.owner);
+            w.u32(uint32(index.deps.size()));
+            for (auto &dep: index.deps)
+                w.str(dep);
+            w.u32(uint32(index.missing.size()));
+            for (auto &missing: index.missing)
+                w.str(missing);
+        }
+
+        w.u32(uint32(dep_scripts.size()));
+        for (auto &script: dep_scripts)
+        {
+            save_fileinfo(w, script);
+            w.str(script.reload_cmd());
+            w.str(script.pkg_base());
+            w.str(script.dep_index);
+        }
+        return w.save(cache_file);
+    }
+
+    // Restores the dependencies graph from a cache file.
+    // Fails if anything the graph was resolved from has changed since it was saved.
+    // The dependency scripts get their current time stamps (their cached hash is kept if they did not change).
+    bool load_cache(const char *cache_file, bool with_hash)
+    {
+        bin_reader_t r;
+        if (!r.load(cache_file) || r.u32() != CACHE_MAGIC || r.u32() != CACHE_VERSION)
+            return false;
+
+        qstring main_file, main_index, trigger_path;
+        r.str(main_file);
+        r.str(main_index);
+        r.str(trigger_path);
+        bool b_keep = r.u8() != 0;
+        bool b_native_mode = r.u8() != 0;
+        size_t arg = size_t(r.u64());
+        qstring loader_path;
+        r.str(loader_path);
+        if (!r.ok || main_file != file_path)
+            return false;
+
+        // The main script still resolves to the same index file
+        qstring index_file;
+        if (deps_file.empty())
+            find_index_file(file_path, index_file);
+        else if (qfileexist(deps_file.c_str()))
+            index_file = deps_file;
+        if (index_file != main_index)
+            return false;
+
+        // Index files: must not have changed
+        std::unordered_map<std::string, dep_index_t> indices;
+        for (uint32 n = r.u32(); r.ok && n != 0; --n)
+        {
+            dep_index_t index;
+            if (!load_fileinfo(r, index))
+                return false;
+
+            r.str(index.owner);
+            for (uint32 ndeps = r.u32(); r.ok && ndeps != 0; --ndeps)
+                r.str(index.deps.push_back());
+            for (uint32 nmissing = r.u32(); r.ok && nmissing != 0; --nmissing)
+            {
+                r.str(index.missing.push_back());
+                if (qfileexist(index.missing.back().c_str()))
+                    return false;
+            }
+            if (!r.ok)
+                return false;
+
+            file_time_t mtime;
+            uint64 size;
+            if (     !get_file_modification_time(index.file_path, &mtime, &size)
+                 ||  mtime != index.modified_time
+                 ||  size != index.file_size)
+            {
+                return false;
+            }
+            std::string key = index.file_path.c_str();
+            indices[key] = std::move(index);
+        }
+
+        // Dependency scripts: must still exist
+        dep_table_t scripts;
+        std::map<std::pair<std::string, std::string>, dep_directive_ptr_t> directives;
+        for (uint32 n = r.u32(); r.ok && n != 0; --n)
+        {
+            script_info_t script;
+            qstring reload_cmd, pkg_base;
+            if (!load_fileinfo(r, script))
+                return false;
+            r.str(reload_cmd);
+            r.str(pkg_base);
+            r.str(script.dep_index);
+            if (!r.ok)
+                return false;
+
+            // An index file appeared, went away or was replaced by the other kind
+            find_index_file(script.file_path, index_file);
+            if (index_file != script.dep_index)
+                return false;
+
+            file_time_t mtime;
+            uint64 size;
+            if (!get_file_modification_time(script.file_path, &mtime, &size))
+                return false;
+
+            if (mtime != script.modified_time || size != script.file_size)
+            {
+                script.modified_time = mtime;
+                script.file_size     = size;
+                script.b_hash        = false;
+            }
+            if (!with_hash)
+                script.b_hash = false;
+            else if (!script.b_hash)
+                script.b_hash = get_file_content_hash(script.file_path.c_str(), &script.content_hash);
+
+            // The scripts listed under the same directives share them again
+            if (!reload_cmd.empty() || !pkg_base.empty())
+            {
+                auto &directive = directives[std::make_pair(std::string(reload_cmd.c_str()), std::string(pkg_base.c_str()))];
+                if (directive == nullptr)
+                    directive = std::make_shared<dep_directive_t>(reload_cmd, pkg_base);
+                script.directive = directive;
+            }
+            scripts.insert(std::move(script));
+        }
+
+        if (!r.ok || r.pos != r.buf.size())
+            return false;
+
+        dep_index = main_index;
+        dep_indices.swap(indices);
+        dep_scripts.swap(scripts);
+        b_keep_trigger_file = b_keep;
+        b_native = b_native_mode;
+        native_arg = arg;
+        loader_input.clear();
+        if (!loader_path.empty())
+            loader_input.refresh(loader_path.c_str());
+        trigger_file.clear();
+        if (!trigger_path.empty())
+            trigger_file.refresh(trigger_path.c_str());
+        return true;
+    }
+
+public:
+    active_script_info_t &operator=(const script_info_t &rhs)
+    {
+        if (this != &rhs)
+        {
+            file_path     = rhs.file_path;
+            modified_time = rhs.modified_time;
+            file_size     = rhs.file_size;
+            content_hash  = rhs.content_hash;
+            b_hash        = rhs.b_hash;
+        }
+        dep_scripts.clear();
+        dep_indices.clear();
+        dep_index.clear();
+        batch.clear();
+        return *this;
+    }
+
+    void clear() override
+    {
+        script_info_t::clear();
+        dep_indices.clear();
+        dep_scripts.clear();
+        trigger_file.clear();
+        b_keep_trigger_file = false;
+        b_native = false;
+        native_arg = 0;
+        loader_input.clear();
+        deps_file.clear();
+        directive.reset();
+        dep_index.clear();
+        batch.clear();
+    }
+};
+
+//-------------------------------------------------------------------------
+// Non-modal scripts chooser
+struct qscripts_chooser_t: public plugmod_t, public chooser_t
+{
+    using chooser_t::operator delete;
+    using chooser_t::operator new;
+
+#ifdef QSCRIPTS_BENCH
+    // The benchmark drives the monitor internals directly
+    friend struct qscripts_bench_t;
+#endif
+
+private:
+    action_manager_t am;
+
+    // The file monitor runs in its own thread and hands over execution plans to the main thread.
+    // The mutex guards the active scripts (and their pending batches) and the pending plans.
+    // The monitor thread only holds it to compare the files it read with the active scripts,
+    // and to apply its results: the files are read, and the plans built, outside of it.
+    std::atomic<bool> m_b_filemon_timer_active{false};
+    std::atomic<bool> m_b_stop_monitor{false};
+    std::thread m_filemon_thread;
+    std::mutex m_wake_mutex;
+    std::condition_variable m_wake_cv;
+    bool m_b_wake_monitor = false;
+#if !defined(__NT__)
+    filemon_waiter_t m_filemon_waiter;
+#endif
+
+    // Adaptive polling: the current interval and when a change was last seen (monitor thread)
+    // Activating the monitor counts as activity.
+    int m_poll_interval = 0;
+    std::chrono::steady_clock::time_point m_last_activity;
+    std::atomic<bool> m_b_poll_reset{true};
+    mutable std::recursive_mutex m_mutex;
+
+    // Bumped when the other threads change the active scripts, including the main thread
+    // refreshing the files info of a script it executes: the results the monitor computed on
+    // a copy of an active script are dropped if it changed meanwhile
+    uint32 m_active_gen = 0;
+
+    // The file monitor belongs to the monitor thread. The other threads queue their
+    // requests, applied before each scan (guarded by m_filemon_req_mutex).
+    filemon_t m_filemon;
+    std::mutex m_filemon_req_mutex;
+    bool m_b_watch_req = false;
+    qstrvec_t m_watch_req;
+    bool m_b_rescan_req = false;
+    std::unique_ptr<filemon_backend_t> m_backend_req;
+    qstrvec_t m_dep_reload_req;
+
+    // Script languages by file extension (main thread only)
+    extlang_cache_t m_extlangs;
+
+    // Execution plans posted to the main thread must not outlive the chooser
+    std::shared_ptr<qscripts_chooser_t *> m_self;
+
+    int opt_change_interval   = 500;
+    int opt_debounce_interval = 100;
+    int opt_clear_log         = 0;
+    int opt_show_filename     = 0;
+    int opt_exec_unload_func  = 0;
+    int opt_with_undo         = 0;
+    int opt_content_hash      = 0;
+    int opt_run_log           = 0;
+    int opt_deps_cache        = 1;
+    int opt_wait_writes       = 1;
+    int opt_auto_rollback     = 0;
+    int opt_ipc               = 0;
+    int opt_result_file       = 0;
+    int opt_shared_watch      = 0;
+
+    // The primary active script: restored on startup and executed by the "execute last active script" action
+    active_script_info_t selected_script;
+
+    // Scripts activated in addition to the primary one. All the active scripts share the same watch set.
+    // Scripts found missing by the monitor thread are only cleared there; the list is pruned on the main thread.
+    std::list<active_script_info_t> m_extra_scripts;
+
+    // The extra scripts as saved in the options (separated by '|')
+    qstring m_extra_scripts_opt;
+    bool m_b_extra_scripts_restored = false;
+
+    // What the main thread has to run after a batch of changes
+    struct exec_plan_t
+    {
+        struct reload_t
+        {
+            qstring script_file;
+            qstring reload_cmd;
+        };
+
+        // The active script when the plan was built
+        qstring script_file;
+
+        // Expanded reload directives, in dependency order
+        qvector<reload_t> reloads;
+
+        bool b_execute = false;
+        bool b_refresh = false;
+
+        // Native mode: the plugin build output to load and run before executing the script
+        qstring native_file;
+        size_t native_arg = 0;
+
+        // Loader mode: the loader input file
+        qstring loader_input;
+
+        // The trigger file that started the plan (if any)
+        qstring trigger_file;
+
+        // Monitor time spent on the changes that led to this plan
+        uint64 detect_us = 0;
+        uint64 parse_us  = 0;
+
+        bool empty() const
+        {
+            return reloads.empty() && !b_execute && !b_refresh && native_file.empty();
+        }
+
+        void clear()
+        {
+            script_file.qclear();
+            reloads.qclear();
+            b_execute = b_refresh = false;
+            native_file.qclear();
+            loader_input.qclear();
+            trigger_file.qclear();
+            native_arg = 0;
+            detect_us = parse_us = 0;
+        }
+
+        // Merges a newer plan into this one. Scripts reloaded by both plans are
+        // reloaded once, in the newer plan's order.
+        void merge(const exec_plan_t &rhs)
+        {
+            if (script_file != rhs.script_file)
+            {
+                reloads.qclear();
+                b_execute = false;
+            }
+            script_file = rhs.script_file;
+
+            for (auto &reload: rhs.reloads)
+            {
+                auto p = std::find_if(reloads.begin(), reloads.end(),
+                    [&reload](const reload_t &r) { return r.script_file == reload.script_file; });
+                if (p != reloads.end())
+                    reloads.erase(p);
+            }
+            reloads.insert(reloads.end(), rhs.reloads.begin(), rhs.reloads.end());
+
+            if (!rhs.native_file.empty())
+            {
+                native_file  = rhs.native_file;
+                native_arg   = rhs.native_arg;
+                loader_input = rhs.loader_input;
+            }
+            if (!rhs.trigger_file.empty())
+                trigger_file = rhs.trigger_file;
+            b_execute |= rhs.b_execute;
+            b_refresh |= rhs.b_refresh;
+            detect_us += rhs.detect_us;
+            parse_us  += rhs.parse_us;
+        }
+    };
+    // One pending plan per active script
+    qvector<exec_plan_t> m_pending_plans;
+    bool m_b_plan_posted = false;
+
+    // Native mode: shadow copies of the plugin builds
+    static constexpr int MAX_NATIVE_COPY_RETRIES = 10;
+    native_loader_t m_native_loader;
+
+    // Consecutive copy failures of the same build output (a new build starts over)
+    int m_native_copy_failures = 0;
+    qstring m_native_copy_file;
+    file_time_t m_native_copy_mtime = 0;
+    uint64 m_native_copy_size = 0;
+
+    // Loader mode on a database that is not temporary: -1 until the user is asked
+    int m_loader_reset_answer = -1;
+
+    // The script being executed on the main thread (if any)
+    qstring m_running_script;
+    int m_nrunning = 0;
+
+    // Set when a newer change makes the running script obsolete.
+    // Long running scripts can poll it with the qscripts_cancelled() IDC function.
+    static inline std::atomic<bool> s_b_cancel_run{false};
+
+    static error_t idaapi idc_qscripts_cancelled(idc_value_t * /*argv*/, idc_value_t *res)
+    {
+        res->set_long(s_b_cancel_run ? 1 : 0);
+        return eOk;
+    }
+
+    // Results of the script stages, kept between runs (main thread only).
+    // Scripts use them through the qscripts_stage_*() IDC functions.
+    static inline stage_cache_t s_stages;
+
+    // qscripts_stage_begin(name, inputs): returns 1 if the stage can be skipped
+    static error_t idaapi idc_qscripts_stage_begin(idc_value_t *argv, idc_value_t *res)
+    {
+        res->set_long(s_stages.begin(argv[0].c_str(), argv[1].c_str()) ? 1 : 0);
+        return eOk;
+    }
+
+    // qscripts_stage_result(name): the stored result of a skipped stage
+    static error_t idaapi idc_qscripts_stage_result(idc_value_t *argv, idc_value_t *res)
+    {
+        qstring result;
+        s_stages.get_result(argv[0].c_str(), &result);
+        res->set_string(result.c_str());
+        return eOk;
+    }
+
+    // qscripts_stage_end(name, result): stores the result of a completed stage
+    static error_t idaapi idc_qscripts_stage_end(idc_value_t *argv, idc_value_t *res)
+    {
+        res->set_long(s_stages.end(argv[0].c_str(), argv[1].c_str()) ? 1 : 0);
+        return eOk;
+    }
+
+    static constexpr const char idc_no_args[]  = { 0 };
+    static constexpr const char idc_str_arg[]  = { VT_STR, 0 };
+    static constexpr const char idc_str_args[] = { VT_STR, VT_STR, 0 };
+    static constexpr ext_idcfunc_t idc_funcs[] =
+    {
+        { "qscripts_cancelled",    idc_qscripts_cancelled,    idc_no_args,  nullptr, 0, EXTFUN_BASE },
+        { "qscripts_stage_begin",  idc_qscripts_stage_begin,  idc_str_args, nullptr, 0, EXTFUN_BASE },
+        { "qscripts_stage_result", idc_qscripts_stage_result, idc_str_arg,  nullptr, 0, EXTFUN_BASE },
+        { "qscripts_stage_end",    idc_qscripts_stage_end,    idc_str_args, nullptr, 0, EXTFUN_BASE },
+    };
+
+    // Timings of the recent runs (main thread only).
+    // m_p_run is the run being timed while a plan is executed.
+    run_history_t m_run_history;
+    run_profile_t *m_p_run = nullptr;
+
+    // The script executed by the undo-able execution action
+    script_info_t *m_p_undo_script = nullptr;
+
+    // Remote trigger channel (see ipc_impl.cpp)
+    static constexpr const char IPC_ENDPOINT_ENV_NAME[] = "QSCRIPTS_IPC_ENDPOINT";
+    ipc_server_t m_ipc;
+
+    // Shared watcher (see watch_impl.cpp): the file monitor uses the shared backend
+    static constexpr const char WATCH_ENDPOINT_ENV_NAME[] = "QSCRIPTS_WATCH_ENDPOINT";
+    bool m_b_shared_watch = false;
+
+    // Runs a remote command on the main thread: activating a script or a plugin run argument
+    struct ipc_request_t: exec_request_t
+    {
+        std::shared_ptr<qscripts_chooser_t *> owner;
+        qstring script_file;
+        size_t arg;
+
+        ipc_request_t(const std::shared_ptr<qscripts_chooser_t *> &owner, const char *script_file, size_t arg)
+            : owner(owner), script_file(script_file), arg(arg)
+        {
+        }
+
+        ssize_t idaapi execute() override
+        {
+            if (*owner != nullptr)
+            {
+                if (!script_file.empty())
+                    (*owner)->activate_script_file(script_file.c_str());
+                else
+                    (*owner)->run(arg);
+            }
+            delete this;
+            return 0;
+        }
+    };
+
+    // Headless mode: the main thread requests (the plans, the remote commands) are executed
+    // by the headless loop instead of the UI (guarded by m_headless_mutex)
+    headless_opts_t m_headless;
+    bool m_b_headless = false;
+    std::mutex m_headless_mutex;
+    std::condition_variable m_headless_cv;
+    qvector<exec_request_t *> m_headless_requests;
+    bool m_b_headless_stop = false;
+    std::atomic<bool> m_b_last_run_ok{false};
+
+    // Auto-rollback: the undo label seen right after the undo point of the previous run,
+    // and the script of that run
+    static constexpr const char ROLLBACK_UNDO_LABEL[] = "QScripts run";
+    qstring m_rollback_label;
+    qstring m_rollback_script;
+    bool m_b_rollback_point = false;
+
+    // Calls a chooser method on the main thread (the pending plan execution, applying the
+    // recent scripts' existence checks). MFF_NOWAIT requests delete themselves.
+    struct main_thread_request_t: exec_request_t
+    {
+        std::shared_ptr<qscripts_chooser_t *> owner;
+        void (qscripts_chooser_t::*method)();
+
+        main_thread_request_t(
+            const std::shared_ptr<qscripts_chooser_t *> &owner,
+            void (qscripts_chooser_t::*method)()): owner(owner), method(method)
+        {
+        }
+
+        ssize_t idaapi execute() override
+        {
+            if (*owner != nullptr)
+                ((*owner)->*method)();
+            delete this;
+            return 0;
+        }
+    };
+
+    struct expand_ctx_t
+    {
+	    // input
+        qstring script_file;
+		bool    main_file;
+        active_script_info_t *active = nullptr;
+		
+		// working
+        qstring base_dir;
+
+        // The directives in effect for the scripts being listed
+        dep_directive_ptr_t directive;
+
+        const qstring &pkg_base() const
+        {
+            static const qstring empty;
+            return directive == nullptr ? empty : directive->pkg_base;
+        }
+
+        const qstring &reload_cmd() const
+        {
+            static const qstring empty;
+            return directive == nullptr ? empty : directive->reload_cmd;
+        }
+    };
+
+    inline int normalize_filemon_interval(const int change_interval) const
+    {
+        return qmax(100, change_interval);
+    }
+
+    inline int normalize_debounce_interval(const int debounce_interval) const
+    {
+        return qmax(0, debounce_interval);
+    }
+
+    const char *get_selected_script_file()
+    {
+        return selected_script.file_path.c_str();
+    }
+
+    // Parses the index file of a script (not recursively).
+    // The listed dependency scripts are returned in 'deps'.
+    // Returns false if the script has no index file.
+    bool parse_deps_for_script(
+        expand_ctx_t &ctx,
+        dep_index_t &dep_index,
+        scripts_info_t &deps)
+    {
+        // Parse the dependency index file
+        qstring dep_file;
+        FILE *fp;
+        if (ctx.main_file && ctx.active != nullptr && !ctx.active->deps_file.empty())
+        {
+            dep_file = ctx.active->deps_file;
+            if ((fp = qfopen(dep_file.c_str(), "r")) == nullptr)
+                return false;
+        }
+        else if ((fp = qfopen(dep_file.sprnt("%s.deps.qscripts", ctx.script_file.c_str()).c_str(), "r")) == nullptr)
+        {
+            dep_file.sprnt("%s.proj.qscripts", ctx.script_file.c_str());
+            fp = qfopen(dep_file.c_str(), "r");
+            if (fp == nullptr)
+                return false;
+        }
+
+        // Get the dependency file directory
+        ctx.base_dir.resize(dep_file.size());
+        qdirname(ctx.base_dir.begin(), ctx.base_dir.size(), dep_file.c_str());
+		ctx.base_dir.resize(strlen(ctx.base_dir.c_str()));
+
+        // Remember the index file and its owner
+        dep_index.owner = ctx.script_file;
+        dep_index.refresh(dep_file.c_str(), opt_content_hash != 0);
+
+        static auto get_value = [](const char* str, const char* key, int key_len) -> const char *
+        {
+            if (strncmp(str, key, key_len) != 0)
+                return nullptr;
+            // Empty value?
+            if (str[key_len] == '\0')
+                return "";
+            else
+                return str + key_len + 1;
+        };
+
+        // Parse each line
+        for (qstring line = dep_file; qgetline(&line, fp) != -1;)
+        {
+            line.trim2();
+
+            // Skip comment lines (';', '//' and '#')
+            if (line.empty() || strncmp(line.c_str(), "//", 2) == 0 || line[0] == '#' || line[0] == ';')
+                continue;
+
+            // Parse special directives (some apply only for the main selected script)
+            if (auto val = get_value(line.c_str(), "/pkgbase", 8))
+            {
+                if (ctx.main_file)
+                {
+                    qstring pkg_base = val;
+                    make_abs_path(pkg_base, ctx.base_dir.c_str(), true);
+                    ctx.directive = std::make_shared<dep_directive_t>(ctx.reload_cmd(), pkg_base);
+                }
+                continue;
+            }
+            else if (auto val = get_value(line.c_str(), "/reload", 7))
+            {
+                if (ctx.main_file)
+                    ctx.directive = std::make_shared<dep_directive_t>(val, ctx.pkg_base());
+                continue;
+            }
+            else if (auto trigger_file = get_value(line.c_str(), "/triggerfile", 12))
+            {
+                if (auto keep = get_value(trigger_file, "/keep", 5))
+                {
+                    trigger_file = keep;
+                    ctx.active->b_keep_trigger_file = true;
+                }
+
+                if (ctx.main_file)
+                {
+                    ctx.active->trigger_file.refresh(trigger_file);
+                    expand_file_name(ctx.active->trigger_file.file_path, ctx);
+                }
+                continue;
+            }
+            else if (auto native_file = get_value(line.c_str(), "/native", 7))
+            {
+                if (ctx.main_file)
+                {
+                    // Optional run argument
+                    if (auto arg = get_value(native_file, "/arg", 4))
+                    {
+                        char *end;
+                        ctx.active->native_arg = size_t(strtoull(arg, &end, 0));
+                        native_file = skip_spaces(end);
+                    }
+
+                    // The build output is never deleted
+                    ctx.active->b_native = ctx.active->b_keep_trigger_file = true;
+                    ctx.active->trigger_file.refresh(native_file);
+                    expand_file_name(ctx.active->trigger_file.file_path, ctx);
+                }
+                continue;
+            }
+            else if (auto input_file = get_value(line.c_str(), "/loader", 7))
+            {
+                if (ctx.main_file)
+                {
+                    qstring input_path = input_file;
+                    expand_file_name(input_path, ctx);
+                    ctx.active->loader_input.refresh(input_path.c_str());
+                }
+                continue;
+            }
+
+            // From here on, the *line* variable is an expandable string leading to a script file
+            ctx.script_file = line;
+            expand_file_name(line, ctx);
+
+            // Skip dependency scripts that (do not|no longer) exist
+            script_info_t dep_script;
+            if (!dep_script.refresh(line.c_str(), opt_content_hash != 0))
+            {
+                dep_index.missing.push_back(line);
+                continue;
+            }
+
+            // Add script
+            dep_script.directive = ctx.directive;
+
+            dep_index.deps.push_back(line);
+            deps.push_back(std::move(dep_script));
+        }
+        qfclose(fp);
+
+        // The loader input is only used by a native build
+        if (ctx.main_file && !ctx.active->loader_input.empty() && !ctx.active->b_native)
+        {
+            msg("QScripts: the /loader directive of '%s' is ignored: it requires the /native directive\n", dep_file.c_str());
+            ctx.active->loader_input.clear();
+        }
+
+        return true;
+    }
+
+    // Re-parses the index files of the given scripts and patches the dependencies graph.
+    // Newly discovered dependencies are parsed in turn. Each index file is parsed once
+    // per update (unless its inherited directives change after it was parsed), and when
+    // a script is listed by more than one index file, the first listing seen sets its
+    // directives. Cycles are reported but not followed. Scripts whose dependencies did not
+    // change keep their time stamps. If 'batch' is passed, then the new dependencies
+    // and the scripts whose dependencies changed are queued for execution.
+    // Returns true if the graph changed.
+    bool update_deps(active_script_info_t &active, qstrvec_t owners, change_batch_t *batch = nullptr)
+    {
+        auto &dep_scripts = active.dep_scripts;
+        auto &dep_indices = active.dep_indices;
+
+        // Scripts whose index file was parsed and scripts whose directives were set during this update
+        std::unordered_set<std::string> parsed, assigned;
+
+        // Parse in the order the scripts are listed
+        std::reverse(owners.begin(), owners.end());
+
+        bool b_changed = false;
+        while (!owners.empty())
+        {
+            qstring owner_file = owners.back();
+            owners.pop_back();
+
+            if (!parsed.insert(owner_file.c_str()).second)
+                continue;
+
+            auto owner = active.find_script(owner_file);
+            if (owner == nullptr)
+                continue;
+
+            // The dependencies inherit the directives in effect where their owner was listed
+            bool main_file = owner == &active;
+            expand_ctx_t ctx = { owner_file, main_file, &active };
+            if (!main_file)
+            {
+                ctx.directive = owner->directive;
+            }
+            else
+            {
+                active.trigger_file.clear();
+                active.b_keep_trigger_file = false;
+                active.b_native = false;
+                active.native_arg = 0;
+                active.loader_input.clear();
+            }
+
+            // Take the previous dependencies out of the graph
+            qstrvec_t old_deps;
+            if (!owner->dep_index.empty())
+            {
+                auto p = dep_indices.find(owner->dep_index.c_str());
+                if (p != dep_indices.end())
+                {
+                    old_deps.swap(p->second.deps);
+                    dep_indices.erase(p);
+                }
+                owner->dep_index.clear();
+            }
+
+            dep_index_t dep_index;
+            scripts_info_t deps;
+            if (parse_deps_for_script(ctx, dep_index, deps))
+            {
+                owner->dep_index = dep_index.file_path;
+                dep_indices[dep_index.file_path.c_str()] = std::move(dep_index);
+            }
+
+            // Patch the dependency scripts
+            qstrvec_t to_parse;
+            for (auto &dep: deps)
+            {
+                auto dep_script = dep_scripts.find(dep.file_path);
+                if (dep_script == nullptr)
+                {
+                    // New dependency: parse its own dependencies too
+                    to_parse.push_back(dep.file_path);
+                    assigned.insert(dep.file_path.c_str());
+                    if (batch != nullptr)
+                        batch->dep_scripts.insert(dep.file_path.c_str());
+                    dep_scripts.insert(std::move(dep));
+                    b_changed = true;
+                }
+                else if (     !dep_script->same_directive(dep)
+                          &&  assigned.insert(dep.file_path.c_str()).second)
+                {
+                    // The inherited directives changed: its own dependencies have to be re-expanded
+                    dep_script->directive = dep.directive;
+                    parsed.erase(dep.file_path.c_str());
+                    to_parse.push_back(dep.file_path);
+                }
+            }
+            owners.insert(owners.end(), to_parse.rbegin(), to_parse.rend());
+
+            // New dependencies may have moved the owner's entry
+            owner = active.find_script(owner_file);
+
+            // Did the owner's dependencies change?
+            auto new_deps = owner->dep_index.empty() ? qstrvec_t() : dep_indices[owner->dep_index.c_str()].deps;
+            std::sort(old_deps.begin(), old_deps.end());
+            std::sort(new_deps.begin(), new_deps.end());
+            if (old_deps != new_deps)
+            {
+                b_changed = true;
+                if (batch != nullptr && !main_file)
+                    batch->dep_scripts.insert(owner_file.c_str());
+            }
+        }
+
+        if (active.remove_unreachable())
+            b_changed = true;
+
+        if (b_changed)
+            report_dep_cycles(active);
+
+        if (b_changed && batch != nullptr)
+            batch->b_main_changed = true;
+
+        update_filemon_watch();
+        return b_changed;
+    }
+
+    void report_dep_cycles(const active_script_info_t &active)
+    {
+        qvector<qstrvec_t> cycles;
+        active.get_dep_cycles(cycles);
+        for (auto &cycle: cycles)
+        {
+            qstring str;
+            for (auto &script_file: cycle)
+                str.cat_sprnt("%s%s", str.empty() ? "" : " -> ", script_file.c_str());
+            msg("QScripts: warning: dependency cycle detected: %s\n", str.c_str());
+        }
+    }
+
+    void expand_file_name(qstring &filename, const expand_ctx_t &ctx)
+    {
+        expand_string(expand_template_t(filename.c_str()), filename, ctx);
+        make_abs_path(filename, ctx.base_dir.c_str(), true);
+    }
+
+    void set_selected_script(script_info_t &script)
+    {
+        std::lock_guard<std::recursive_mutex> lock(m_mutex);
+        drop_pending_plan(selected_script.file_path);
+
+        // The new primary script may have been an extra active script
+        qstring script_file = script.file_path;
+        if (auto extra = find_extra_script(script_file))
+        {
+            deactivate_script(*extra);
+            prune_extra_scripts();
+            save_extra_scripts();
+        }
+
+        // Activate script
+        activate_script(selected_script, script);
+    }
+
+    // Activates a script in addition to the primary one, or deactivates it if it already is.
+    // Returns the newly activated script.
+    active_script_info_t *toggle_extra_script(script_info_t &script)
+    {
+        std::lock_guard<std::recursive_mutex> lock(m_mutex);
+        if (script.file_path == selected_script.file_path)
+            return nullptr;
+
+        restore_extra_scripts();
+
+        active_script_info_t *activated = nullptr;
+        if (auto extra = find_extra_script(script.file_path))
+        {
+            deactivate_script(*extra);
+        }
+        else
+        {
+            m_extra_scripts.emplace_back();
+            activate_script(m_extra_scripts.back(), script);
+            activated = &m_extra_scripts.back();
+        }
+        prune_extra_scripts();
+        save_extra_scripts();
+        return activated;
+    }
+
+    // Sets up an active script and its dependencies graph
+    void activate_script(active_script_info_t &active, const script_info_t &script)
+    {
+        ++m_active_gen;
+        active = script;
+
+        // Restore the dependencies graph from its cache if it is still valid
+        qstring cache_file;
+        bool b_cache = opt_deps_cache && get_deps_cache_file(active, cache_file);
+        if (b_cache && active.load_cache(cache_file.c_str(), opt_content_hash != 0))
+        {
+            update_filemon_watch();
+            return;
+        }
+
+        // Recursively parse the dependencies and the index files
+        qstrvec_t owners;
+        owners.push_back(active.file_path);
+        update_deps(active, owners);
+        if (b_cache)
+            save_deps_cache(active);
+    }
+
+    // Deactivates a single active script. Extra scripts are only cleared (see prune_extra_scripts)
+    void deactivate_script(active_script_info_t &active)
+    {
+        std::lock_guard<std::recursive_mutex> lock(m_mutex);
+        drop_pending_plan(active.file_path);
+        ++m_active_gen;
+        active.clear();
+        update_filemon_watch();
+
+        // ...and deactivate the monitor if nothing is left to monitor
+        if (!has_active_scripts())
+            activate_monitor(false);
+    }
+
+    // Removes the deactivated extra scripts (main thread only)
+    void prune_extra_scripts()
+    {
+        std::lock_guard<std::recursive_mutex> lock(m_mutex);
+        m_extra_scripts.remove_if([](const active_script_info_t &active) { return active.empty(); });
+    }
+
+    active_script_info_t *find_extra_script(const qstring &script_file)
+    {
+        for (auto &active: m_extra_scripts)
+        {
+            if (!active.empty() && active.file_path == script_file)
+                return &active;
+        }
+        return nullptr;
+    }
+
+    bool is_extra_script(const qstring &script_file) const
+    {
+        return const_cast<qscripts_chooser_t *>(this)->find_extra_script(script_file) != nullptr;
+    }
+
+    // Returns the active script (primary or extra) of a given file
+    active_script_info_t *find_active_script(const qstring &script_file)
+    {
+        if (!script_file.empty() && selected_script.file_path == script_file)
+            return &selected_script;
+        return find_extra_script(script_file);
+    }
+
+    // Calls 'cb' for each active script (primary first)
+    template <typename F> void for_each_active_script(F cb)
+    {
+        std::lock_guard<std::recursive_mutex> lock(m_mutex);
+        if (!selected_script.empty())
+            cb(selected_script);
+        for (auto &active: m_extra_scripts)
+        {
+            if (!active.empty())
+                cb(active);
+        }
+    }
+
+    // Is the file a dependency of any of the active scripts?
+    const script_info_t *has_active_dep(const qstring &dep_file) const
+    {
+        std::lock_guard<std::recursive_mutex> lock(m_mutex);
+        if (auto dep = selected_script.has_dep(dep_file))
+            return dep;
+        for (auto &active: m_extra_scripts)
+        {
+            if (auto dep = active.has_dep(dep_file))
+                return dep;
+        }
+        return nullptr;
+    }
+
+    void save_extra_scripts()
+    {
+        saveload_options(true, OPTID_EXTRASCRIPTS);
+    }
+
+    // Activates the extra scripts saved in the options (once)
+    void restore_extra_scripts()
+    {
+        std::lock_guard<std::recursive_mutex> lock(m_mutex);
+        if (m_b_extra_scripts_restored)
+            return;
+        m_b_extra_scripts_restored = true;
+
+        qstrvec_t files;
+        for (const char *p = m_extra_scripts_opt.c_str(); *p != '\0';)
+        {
+            const char *end = strchr(p, '|');
+            if (end == nullptr)
+                end = p + strlen(p);
+            files.push_back(qstring(p, end - p));
+            p = *end == '\0' ? end : end + 1;
+        }
+
+        for (auto &file: files)
+        {
+            script_info_t script(file.c_str());
+            if (     file.empty()
+                 ||  file == selected_script.file_path
+                 ||  find_extra_script(file) != nullptr
+                 || !script.refresh())
+            {
+                continue;
+            }
+            m_extra_scripts.emplace_back();
+            activate_script(m_extra_scripts.back(), script);
+        }
+    }
+
+    // The dependencies graph cache file lives next to the root index file
+    bool get_deps_cache_file(const active_script_info_t &active, qstring &cache_file)
+    {
+        if (!active.deps_file.empty())
+        {
+            cache_file.sprnt("%s.cache", active.deps_file.c_str());
+            return qfileexist(active.deps_file.c_str());
+        }
+
+        static const char *const index_exts[] = { ".deps.qscripts", ".proj.qscripts" };
+        for (auto ext: index_exts)
+        {
+            cache_file.sprnt("%s%s", active.file_path.c_str(), ext);
+            if (qfileexist(cache_file.c_str()))
+            {
+                cache_file.append(".cache");
+                return true;
+            }
+        }
+        return false;
+    }
+
+    void save_deps_cache(const active_script_info_t &active)
+    {
+        qstring cache_file;
+        if (     opt_deps_cache
+             &&  get_deps_cache_file(active, cache_file)
+             && !active.save_cache(cache_file.c_str()))
+        {
+            msg("QScripts: failed to save the dependencies cache file '%s'\n", cache_file.c_str());
+        }
+    }
+
+    // Watch the active scripts, their trigger files, index files and dependencies.
+    // Files shared by several active scripts are watched once.
+    void update_filemon_watch()
+    {
+        std::lock_guard<std::recursive_mutex> lock(m_mutex);
+        qstrvec_t files;
+        for_each_active_script([&files](active_script_info_t &active)
+        {
+            files.push_back(active.file_path);
+            if (active.trigger_based())
+                files.push_back(active.trigger_file.file_path);
+            if (!active.loader_input.empty())
+                files.push_back(active.loader_input.file_path);
+            for (auto &kv: active.dep_indices)
+                files.push_back(kv.second.file_path);
+            for (auto &dep_script: active.dep_scripts)
+                files.push_back(dep_script.file_path);
+        });
+
+        {
+            std::lock_guard<std::mutex> req_lock(m_filemon_req_mutex);
+            m_watch_req.swap(files);
+            m_b_watch_req = true;
+        }
+        wake_monitor();
+    }
+
+    // Asks the monitor thread to check all the watched files on its next scan
+    void request_filemon_rescan()
+    {
+        {
+            std::lock_guard<std::mutex> req_lock(m_filemon_req_mutex);
+            m_b_rescan_req = true;
+        }
+        wake_monitor();
+    }
+
+    // Asks the monitor thread to switch to another file monitor backend
+    void request_filemon_backend(filemon_backend_t *backend)
+    {
+        {
+            std::lock_guard<std::mutex> req_lock(m_filemon_req_mutex);
+            m_backend_req.reset(backend);
+        }
+        wake_monitor();
+    }
+
+    // Applies the queued requests to the file monitor (monitor thread)
+    void apply_filemon_requests()
+    {
+        bool b_watch, b_rescan;
+        qstrvec_t files, dep_reloads;
+        std::unique_ptr<filemon_backend_t> backend;
+        {
+            std::lock_guard<std::mutex> req_lock(m_filemon_req_mutex);
+            b_watch  = m_b_watch_req;
+            b_rescan = m_b_rescan_req;
+            files.swap(m_watch_req);
+            backend.swap(m_backend_req);
+            dep_reloads.swap(m_dep_reload_req);
+            m_b_watch_req = m_b_rescan_req = false;
+        }
+
+        // Reloads requested remotely: queued as changes that are already due
+        if (!dep_reloads.empty())
+        {
+            std::lock_guard<std::recursive_mutex> lock(m_mutex);
+            for_each_active_script([&](active_script_info_t &active)
+            {
+                for (auto &dep_file: dep_reloads)
+                {
+                    if (active.has_dep(dep_file) == nullptr)
+                        continue;
+                    active.batch.dep_scripts.insert(dep_file.c_str());
+                    active.batch.last_change = std::chrono::steady_clock::time_point();
+                }
+            });
+        }
+
+        if (backend)
+            m_filemon.set_backend(backend.release());
+        if (b_watch && files.empty())
+            m_filemon.unwatch();
+        else if (b_watch)
+            m_filemon.watch(files);
+        if (b_rescan)
+            m_filemon.request_rescan();
+    }
+
+    // Deactivates all the active scripts
+    void clear_selected_script()
+    {
+        std::lock_guard<std::recursive_mutex> lock(m_mutex);
+        m_pending_plans.qclear();
+        ++m_active_gen;
+        selected_script.clear();
+        for (auto &active: m_extra_scripts)
+            active.clear();
+        update_filemon_watch();
+        // ...and deactivate the monitor
+        activate_monitor(false);
+    }
+
+    const bool has_selected_script()
+    {
+        std::lock_guard<std::recursive_mutex> lock(m_mutex);
+        return !selected_script.file_path.empty();
+    }
+
+    const bool has_active_scripts()
+    {
+        std::lock_guard<std::recursive_mutex> lock(m_mutex);
+        if (!selected_script.empty())
             return true;
+        for (auto &active: m_extra_scripts)
+        {
+            if (!active.empty())
+                return true;
+        }
+        return false;
+    }
+
+    bool is_monitor_active() const { return m_b_filemon_timer_active; }
+
+    // Dynamic string expansion
+	// ------------------------
+    // basename                       Returns the basename of the input file
+    // env:Variable_Name              Expands the 'Variable_Name'
+    // pkgbase                        Sets the current pkgbase path
+    // pkgmodname                     Expands the file name using the pckbase into the form: 'module.submodule1.submodule2'
+    void expand_string(const expand_template_t &tpl, qstring &output, const expand_ctx_t& ctx)
+    {
+        // Size the output for the common case where each variable expands to at most a path
+        qstring result;
+        result.reserve(tpl.literal_size + tpl.nvars * (ctx.script_file.length() + 1));
+
+        for (auto &seg: tpl.segments)
+        {
+            switch (seg.kind)
+            {
+                case expand_seg_e::literal:
+                    result.append(seg.text);
+                    break;
+                case expand_seg_e::pkgmodname:
+                {
+                    const active_script_info_t &active = ctx.active != nullptr ? *ctx.active : selected_script;
+                    auto dep_file = active.has_dep(ctx.script_file.c_str());
+                    const qstring &pkg_base = dep_file == nullptr ? active.pkg_base() : dep_file->pkg_base();
+
+                    // If the script file is in the package base, then replace the path separators with '.'
+                    if (strncmp(ctx.script_file.c_str(), pkg_base.c_str(), pkg_base.length()) == 0)
+                    {
+                        qstring s = ctx.script_file.c_str() + pkg_base.length() + 1;
+                        s.replace(SDIRCHAR, ".");
+                        // Drop the extension too
+                        auto idx = s.rfind('.');
+                        if (idx != -1)
+                            s.resize(idx);
+
+                        result.append(s);
+                    }
+                    break;
+                }
+                case expand_seg_e::pkgbase:
+                    result.append(ctx.pkg_base());
+                    break;
+                case expand_seg_e::basename:
+                {
+                    char *basename, *ext;
+                    qstring wrk_str;
+                    if (get_basename_and_ext(ctx.script_file.c_str(), &basename, &ext, wrk_str))
+                        result.append(basename);
+                    else
+                        result.append(wrk_str.c_str());
+                    break;
+                }
+                case expand_seg_e::env:
+                {
+                    qstring env;
+                    if (qgetenv(seg.text.c_str() + 4, &env))
+                        result.append(env);
+                    else
+                        result.append(seg.text);
+                    break;
+                }
+                case expand_seg_e::unknown:
+                    result.append(seg.text);
+                    break;
+            }
+        }
+        output.swap(result);
+    }
+
+    // Expands the reload directive of a dependency script
+    void expand_reload_cmd(active_script_info_t &active, const script_info_t &dep_script, qstring &reload_cmd)
+    {
+        if (!dep_script.has_reload_directive())
+        {
+            reload_cmd.qclear();
+            return;
+        }
+
+        expand_ctx_t ctx;
+        ctx.script_file = dep_script.file_path;
+        ctx.active      = &active;
+        expand_string(dep_script.directive->reload_tpl, reload_cmd, ctx);
+    }
+
+    // Executes the reload directives of a plan, in dependency order. The consecutive reloads of
+    // the same language run as a single snippet. If a snippet fails, its reloads are executed
+    // again one by one, up to the first failing one, to find the failing dependency.
+    bool execute_reloads(const exec_plan_t &plan, run_profile_t &run)
+    {
+        struct lang_reloads_t
+        {
+            extlang_object_t elang;
+            qvector<const exec_plan_t::reload_t *> reloads;
+        };
+        qvector<lang_reloads_t> runs;
+        for (auto &reload: plan.reloads)
+        {
+            extlang_object_t elang(m_extlangs.find(reload.script_file.c_str()));
+            if (elang == nullptr)
+            {
+                run.error.sprnt("unknown script language detected for '%s'", reload.script_file.c_str());
+                msg("QScripts: warning: failed to execute reload directive: %s!\n", run.error.c_str());
+                return false;
+            }
+
+            if (runs.empty() || (extlang_t *)runs.back().elang != (extlang_t *)elang)
+                runs.push_back(lang_reloads_t{ elang, {} });
+            runs.back().reloads.push_back(&reload);
+        }
+
+        stopwatch_t sw;
+        for (auto &lang: runs)
+        {
+            qstring snippet, err;
+            for (auto reload: lang.reloads)
+            {
+                snippet.append(reload->reload_cmd);
+                snippet.append('\n');
+            }
+
+            // The reloads of a snippet are timed together: each one gets an even share
+            sw.reset();
+            bool ok = lang.elang->eval_snippet(snippet.c_str(), &err);
+            uint64 us = sw.elapsed_us();
+            run[run_phase_e::reload] += us;
+            if (ok)
+            {
+                for (auto reload: lang.reloads)
+                {
+                    auto &rt = run.reloads.push_back();
+                    rt.script_file = reload->script_file;
+                    rt.us = us / lang.reloads.size();
+                }
+                continue;
+            }
+
+            if (lang.reloads.size() == 1)
+            {
+                run.error.sprnt("failed to execute reload directive of '%s': %s", lang.reloads[0]->script_file.c_str(), err.c_str());
+                msg("QScripts: warning: %s\n", run.error.c_str());
+                return false;
+            }
+
+            msg("QScripts: warning: the reload of %zu scripts failed, reloading them one by one...\n", lang.reloads.size());
+            for (auto reload: lang.reloads)
+            {
+                err.qclear();
+                sw.reset();
+                ok = lang.elang->eval_snippet(reload->reload_cmd.c_str(), &err);
+                auto &rt = run.reloads.push_back();
+                rt.script_file = reload->script_file;
+                rt.us = sw.elapsed_us();
+                run[run_phase_e::reload] += rt.us;
+                if (!ok)
+                {
+                    run.error.sprnt("failed to execute reload directive of '%s': %s", reload->script_file.c_str(), err.c_str());
+                    msg("QScripts: warning: %s\n", run.error.c_str());
+                    return false;
+                }
+            }
+
+            // Each reload succeeded on its own: go on
+        }
+        return true;
+    }
+
+    // Auto-rollback: reverts the database to the undo point of the previous run and records a new one.
+    // The previous run is only undone if nothing else was done in the database since.
+    void rollback_previous_run(const qstring &script_file)
+    {
+        if (m_b_rollback_point)
+        {
+            m_b_rollback_point = false;
+
+            // The undo history is linear: undoing another active script's run would
+            // take its changes away, so only the runs of the same script are rolled back
+            qstring label;
+            if (m_rollback_script != script_file)
+            {
+                msg("QScripts: the previous run was not rolled back (it was a run of '%s')\n", m_rollback_script.c_str());
+            }
+            else if (get_undo_action_label(&label) && label == m_rollback_label && perform_undo())
+            {
+                // The effects of the skipped stages are gone as well
+                s_stages.clear();
+            }
+            else
+            {
+                msg("QScripts: warning: the previous run was not rolled back (the database was changed since)\n");
+            }
+        }
+
+        if (create_undo_point((const uchar *)ROLLBACK_UNDO_LABEL, sizeof(ROLLBACK_UNDO_LABEL))
+            && get_undo_action_label(&m_rollback_label))
+        {
+            m_rollback_script = script_file;
+            m_b_rollback_point = true;
+        }
+    }
+
+    bool execute_script(script_info_t *script_info, bool with_undo)
+    {
+        // Auto-rollback already makes the run undo-able, directly.
+        // The runs of a plan were rolled back before their reloads.
+        if (opt_auto_rollback)
+        {
+            if (m_p_run == nullptr)
+                rollback_previous_run(script_info->file_path);
+            return execute_script_sync(script_info);
+        }
+
+        if (!with_undo)
+            return execute_script_sync(script_info);
+
+        m_p_undo_script = script_info;
+        bool ok = process_ui_action(ACTION_EXECUTE_SCRIPT_WITH_UNDO_ID);
+        m_p_undo_script = nullptr;
+        return ok;
+    }
+
+    // Marks the start of a script execution. The file monitor keeps running meanwhile:
+    // the changes seen during the execution are queued and cancel the running script.
+    void begin_run(const qstring &script_file)
+    {
+        std::lock_guard<std::recursive_mutex> lock(m_mutex);
+        if (m_nrunning++ == 0)
+        {
+            m_running_script = script_file;
+            s_b_cancel_run = false;
+        }
+    }
+
+    // Marks the end of a script execution and runs what was queued meanwhile
+    void end_run()
+    {
+        std::lock_guard<std::recursive_mutex> lock(m_mutex);
+        if (--m_nrunning != 0)
+            return;
+
+        m_running_script.qclear();
+        s_b_cancel_run = false;
+        if (!m_pending_plans.empty() && !m_b_plan_posted)
+        {
+            post_pending_plans();
+        }
+    }
+
+    // The language of a script. Only the cache holds on to the extlangs: the scripts are
+    // copied around and would keep the extlangs of the plugins being unloaded alive.
+    extlang_object_t find_script_extlang(const script_info_t &script_info)
+    {
+        return m_extlangs.find(script_info.file_path.c_str());
+    }
+
+    static ssize_t idaapi ui_callback(void *user_data, int notification_code, va_list)
+    {
+        auto self = (qscripts_chooser_t *)user_data;
+        switch (notification_code)
+        {
+            // Extlangs are installed and removed by plugins
+            case ui_plugin_loaded:
+            case ui_plugin_unloading:
+                self->m_extlangs.invalidate();
+                break;
+            // The database is ready: start the headless mode if it was configured
+            case ui_ready_to_run:
+                if (self->m_headless.is_enabled() || !self->m_headless.error.empty())
+                    qexit(self->run_headless());
+                break;
+        }
+        return 0;
+    }
+
+    // Headless mode: executes the root script and, in watch mode, executes the plans posted by
+    // the monitor on this thread until the timeout. Returns the exit status.
+    int run_headless()
+    {
+        if (!m_headless.error.empty())
+        {
+            msg("QScripts: headless: %s", m_headless.error.c_str());
+            return HEADLESS_BAD_OPTIONS;
+        }
+
+        script_info_t script(m_headless.script_file.c_str());
+        if (!script.refresh())
+        {
+            msg("QScripts: headless: script file '%s' not found!\n", m_headless.script_file.c_str());
+            return HEADLESS_BAD_OPTIONS;
+        }
+        {
+            std::lock_guard<std::mutex> lock(m_headless_mutex);
+            m_b_headless = true;
+            m_b_headless_stop = false;
+        }
+
+        // Analyze the database first, as a batch run would
+        auto_wait();
+
+        {
+            std::lock_guard<std::recursive_mutex> lock(m_mutex);
+            clear_selected_script();
+            selected_script.deps_file = m_headless.deps_file;
+            set_selected_script(script);
+        }
+        msg("QScripts: headless: executing '%s'...\n", script.file_path.c_str());
+        bool ok = execute_script(&selected_script, false);
+
+        if (m_headless.b_watch)
+        {
+            msg("QScripts: headless: watching the dependencies of '%s'...\n", script.file_path.c_str());
+            m_b_last_run_ok = ok;
+            activate_monitor(true);
+
+            // The 'stop' remote command ends the watch
+            update_ipc_server(true);
+
+            stopwatch_t sw;
+            uint64 timeout_us = uint64(m_headless.timeout_secs) * 1000000;
+            for (bool b_stop = false; !b_stop && (timeout_us == 0 || sw.elapsed_us() < timeout_us); )
+            {
+                qvector<exec_request_t *> requests;
+                {
+                    std::unique_lock<std::mutex> lock(m_headless_mutex);
+                    m_headless_cv.wait_for(
+                        lock,
+                        std::chrono::milliseconds(100),
+                        [this] { return !m_headless_requests.empty() || m_b_headless_stop; });
+                    requests.swap(m_headless_requests);
+                    b_stop = m_b_headless_stop;
+                }
+                for (auto req: requests)
+                    req->execute();
+            }
+            if (!opt_ipc)
+                m_ipc.stop();
+            activate_monitor(false);
+            ok = m_b_last_run_ok;
+        }
+
+        // IDA exits: the requests left are dropped
+        {
+            std::lock_guard<std::mutex> lock(m_headless_mutex);
+            m_b_headless = false;
+            for (auto req: m_headless_requests)
+                delete req;
+            m_headless_requests.qclear();
+        }
+
+        msg("QScripts: headless: done (%s)\n", ok ? "success" : "failure");
+        return ok ? HEADLESS_OK : HEADLESS_RUN_FAILED;
+    }
+
+    // Executes a script file
+    bool execute_script_sync(script_info_t *script_info)
+    {
+        bool exec_ok = false;
+
+        // Time this execution as part of the current run or as a run on its own
+        run_profile_t local_run;
+        run_profile_t &run = m_p_run != nullptr ? *m_p_run : local_run;
+        stopwatch_t sw;
+
+        qstring script_path;
+        {
+            std::lock_guard<std::recursive_mutex> lock(m_mutex);
+            script_path = script_info->file_path;
+        }
+        begin_run(script_path);
+        do
+        {
+            {
+                std::lock_guard<std::recursive_mutex> lock(m_mutex);
+
+                // First things first: always take the file's modification timestamp first so not to visit it again in the file monitor timer
+                // The script may be an active one: a copy the monitor is planning with is now stale.
+                ++m_active_gen;
+                if (!script_info->refresh(nullptr, opt_content_hash != 0))
+                {
+                    run.error.sprnt("script file '%s' not found", script_path.c_str());
+                    msg("Script file '%s' not found!\n", script_path.c_str());
+                    break;
+                }
+            }
+            auto script_file = script_path.c_str();
+            run.script_file = script_path;
+            s_stages.new_run(script_file);
+
+            extlang_object_t elang(find_script_extlang(*script_info));
+            if (elang == nullptr)
+            {
+                run.error.sprnt("unknown script language detected for '%s'", script_file);
+                msg("Unknown script language detected for '%s'!\n", script_file);
+                break;
+            }
+
+            if (opt_clear_log)
+                msg_clear();
+
+            // Silently call the unload script function
+            qstring errbuf;
+            if (opt_exec_unload_func)
+            {
+                idc_value_t result;
+                sw.reset();
+                elang->call_func(&result, UNLOAD_SCRIPT_FUNC_NAME, &result, 0, &errbuf);
+                run[run_phase_e::unload] += sw.lap_us();
+            }
+
+            if (opt_show_filename)
+                msg("QScripts executing %s...\n", script_file);
+
+            sw.reset();
+            exec_ok = elang->compile_file(script_file, &errbuf);
+            run[run_phase_e::compile] += sw.lap_us();
+            if (!exec_ok)
+            {
+                run.error = errbuf;
+                msg("QScripts failed to compile script file: '%s':\n%s", script_file, errbuf.c_str());
+                break;
+            }
+
+            // Special case for IDC scripts: we have to call 'main'
+            if (elang->is_idc())
+            {
+                idc_value_t result;
+                exec_ok = elang->call_func(&result, "main", &result, 0, &errbuf);
+                run[run_phase_e::run] += sw.lap_us();
+                if (!exec_ok)
+                {
+                    run.error = errbuf;
+                    msg("QScripts failed to run the IDC main() of file '%s':\n%s", script_file, errbuf.c_str());
+                    break;
+                }
+            }
         } while (false);
+        end_run();
+
+        run.b_ok = exec_ok;
+        if (&run == &local_run)
+            record_run(run);
+
+        return exec_ok;
+    }
+
+    // Adds a timed run to the history and optionally to the run log file
+    void record_run(run_profile_t &run)
+    {
+        run.when = time(nullptr);
+        m_b_last_run_ok = run.b_ok;
+        m_run_history.add(run);
+
+        if (opt_run_log)
+        {
+            qstring log_file;
+            log_file.sprnt("%s" SDIRCHAR "%s", get_user_idadir(), RUN_LOG_FILE_NAME);
+            if (!append_run_log(log_file.c_str(), run))
+                msg("QScripts: failed to write to the run log file '%s'\n", log_file.c_str());
+        }
+
+        // Report the run to the external tools
+        if (opt_result_file && !run.script_file.empty())
+        {
+            qstring result_file;
+            result_file.sprnt("%s%s", run.script_file.c_str(), RESULT_FILE_EXT);
+            if (!write_run_result(result_file.c_str(), run))
+                msg("QScripts: failed to write the run result file '%s'\n", result_file.c_str());
+        }
+        if (m_ipc.is_running())
+        {
+            qstring line("result ");
+            qstring json;
+            run.to_json(json);
+            line.append(json);
+            m_ipc.send_all(line);
+        }
+        refresh_chooser(QSCRIPTS_TITLE);
+    }
+
+    enum {
+        OPTID_INTERVAL       = 0x0001,
+        OPTID_CLEARLOG       = 0x0002,
+        OPTID_SHOWNAME       = 0x0004,
+        OPTID_UNLOADEXEC     = 0x0008,
+        OPTID_SELSCRIPT      = 0x0010,
+        OPTID_WITHUNDO       = 0x0020,
+        OPTID_DEBOUNCE       = 0x0040,
+        OPTID_CONTENTHASH    = 0x0080,
+        OPTID_RUNLOG         = 0x0100,
+        OPTID_DEPSCACHE      = 0x0200,
+        OPTID_EXTRASCRIPTS   = 0x0400,
+        OPTID_WAITWRITES     = 0x0800,
+        OPTID_AUTOROLLBACK   = 0x1000,
+        OPTID_IPC            = 0x2000,
+        OPTID_RESULTFILE     = 0x4000,
+        OPTID_SHAREDWATCH    = 0x8000,
+
+        OPTID_ONLY_SCRIPT    = OPTID_SELSCRIPT,
+        OPTID_ALL_BUT_SCRIPT = 0xffff & ~(OPTID_ONLY_SCRIPT | OPTID_EXTRASCRIPTS),
+        OPTID_ALL            = 0xffff,
+    };
+
+    // Save or load the options
+    void saveload_options(bool bsave, int what_ids = OPTID_ALL)
+    {
+        std::lock_guard<std::recursive_mutex> lock(m_mutex);
+        enum { QSTR = 1000 };
+        struct options_t
+        {
+            int id;
+            const char *name;
+            int vtype;
+            void *pval;
+        } int_options [] =
+        {
+            {OPTID_INTERVAL,   "QScripts_interval",             VT_LONG, &opt_change_interval},
+            {OPTID_DEBOUNCE,   "QScripts_debounce",             VT_LONG, &opt_debounce_interval},
+            {OPTID_CLEARLOG,   "QScripts_clearlog",             VT_LONG, &opt_clear_log},
+            {OPTID_SHOWNAME,   "QScripts_showscriptname",       VT_LONG, &opt_show_filename},
+            {OPTID_UNLOADEXEC, "QScripts_exec_unload_func",     VT_LONG, &opt_exec_unload_func},
+            {OPTID_SELSCRIPT,  "QScripts_selected_script_name", QSTR, &selected_script.file_path},
+            {OPTID_WITHUNDO,   "QScripts_with_undo",            VT_LONG, &opt_with_undo},
+            {OPTID_CONTENTHASH,"QScripts_content_hash",         VT_LONG, &opt_content_hash},
+            {OPTID_RUNLOG,     "QScripts_run_log",              VT_LONG, &opt_run_log},
+            {OPTID_DEPSCACHE,  "QScripts_deps_cache",           VT_LONG, &opt_deps_cache},
+            {OPTID_WAITWRITES, "QScripts_wait_writes",          VT_LONG, &opt_wait_writes},
+            {OPTID_AUTOROLLBACK,"QScripts_auto_rollback",       VT_LONG, &opt_auto_rollback},
+            {OPTID_IPC,        "QScripts_ipc",                  VT_LONG, &opt_ipc},
+            {OPTID_RESULTFILE, "QScripts_result_file",          VT_LONG, &opt_result_file},
+            {OPTID_SHAREDWATCH,"QScripts_shared_watch",         VT_LONG, &opt_shared_watch},
+            {OPTID_EXTRASCRIPTS,"QScripts_extra_scripts",       QSTR, &m_extra_scripts_opt}
+        };
+
+        // The extra scripts saved before they were restored are kept as they are
+        if (bsave && (what_ids & OPTID_EXTRASCRIPTS) != 0 && m_b_extra_scripts_restored)
+        {
+            m_extra_scripts_opt.qclear();
+            for (auto &active: m_extra_scripts)
+            {
+                if (active.empty())
+                    continue;
+                if (!m_extra_scripts_opt.empty())
+                    m_extra_scripts_opt.append('|');
+                m_extra_scripts_opt.append(active.file_path);
+            }
+        }
+
+        for (auto &opt: int_options)
+        {
+            if ((what_ids & opt.id) == 0)
+                continue;
+
+            if (opt.vtype == VT_LONG)
+            {
+                if (bsave)
+                    reg_write_int(opt.name, *(int *)opt.pval);
+                else
+                    *(int *)opt.pval = reg_read_int(opt.name, *(int *)opt.pval);
+            }
+            else if (opt.vtype == VT_STR)
+            {
+                if (bsave)
+                    reg_write_string(opt.name, ((qstring *)opt.pval)->c_str());
+                else
+                    reg_read_string(((qstring *)opt.pval), opt.name);
+            }
+            else if (opt.vtype == QSTR)
+            {
+                if (bsave)
+                {
+                    reg_write_string(opt.name, ((qstring *)opt.pval)->c_str());
+                }
+                else
+                {
+                    qstring tmp;
+                    reg_read_string(&tmp, opt.name);
+                    *((qstring *)opt.pval) = tmp.c_str();
+                }
+            }
+        }
+
+        if (!bsave)
+        {
+            opt_change_interval   = normalize_filemon_interval(opt_change_interval);
+            opt_debounce_interval = normalize_debounce_interval(opt_debounce_interval);
+        }
+    }
 
-        if (!silent)
-            msg("QScripts failed to reload script file: '%s':\n%s", script_file, err.c_str());
+    // The monitor thread: scans for changes and sleeps until the next tick
+    void filemon_thread_proc()
+    {
+        while (!m_b_stop_monitor)
+        {
+            int interval = filemon_timer_cb();
 
-        return false;
+#if !defined(__NT__)
+            // Block on the backend's events too
+            int event_fd = m_filemon.event_fd();
+            if (event_fd != -1 && m_filemon_waiter.ok())
+            {
+                {
+                    std::lock_guard<std::mutex> lock(m_wake_mutex);
+                    if (m_b_wake_monitor || m_b_stop_monitor)
+                    {
+                        m_b_wake_monitor = false;
+                        continue;
+                    }
+                }
+                m_filemon_waiter.wait(event_fd, interval);
+
+                std::lock_guard<std::mutex> lock(m_wake_mutex);
+                m_b_wake_monitor = false;
+                continue;
+            }
+#endif
+            std::unique_lock<std::mutex> lock(m_wake_mutex);
+            m_wake_cv.wait_for(
+                lock,
+                std::chrono::milliseconds(interval),
+                [this] { return m_b_wake_monitor || m_b_stop_monitor; });
+            m_b_wake_monitor = false;
+        }
     }
 
-    bool execute_script(script_info_t *script_info, bool with_undo)
+    // The adaptive polling interval (monitor thread)
+    int get_poll_interval(bool b_activity)
     {
-        if (with_undo)
-            return process_ui_action(ACTION_EXECUTE_SCRIPT_WITH_UNDO_ID);
+        auto now = std::chrono::steady_clock::now();
+        if (m_b_poll_reset.exchange(false) || b_activity)
+            m_last_activity = now;
+
+        auto idle_ms = std::chrono::duration_cast<std::chrono::milliseconds>(now - m_last_activity).count();
+        if (     idle_ms < FAST_POLL_GRACE
+             || (idle_ms < FOCUS_POLL_GRACE && !is_foreground_process()))
+        {
+            m_poll_interval = opt_change_interval;
+        }
         else
-            return execute_script_sync(script_info);
+        {
+            m_poll_interval = qmin(qmax(m_poll_interval, opt_change_interval) * 2, qmax(opt_change_interval, MAX_IDLE_POLL_INTERVAL));
+        }
+        return m_poll_interval;
     }
 
-    // Executes a script file
-    bool execute_script_sync(script_info_t *script_info)
+    // Wakes the monitor thread up for an immediate scan
+    void wake_monitor()
     {
-        bool exec_ok = false;
+        {
+            std::lock_guard<std::mutex> lock(m_wake_mutex);
+            m_b_wake_monitor = true;
+        }
+        m_wake_cv.notify_one();
+#if !defined(__NT__)
+        m_filemon_waiter.wake();
+#endif
+    }
 
-        // Pause the file monitor timer while executing a script
-        bool old_state = activate_monitor(false);
+    // Collects the changes reported by the file monitor into the pending batch of an active script.
+    // The files metadata is shared between the active scripts through 'stats'.
+    // Returns false if the active script no longer exists.
+    bool collect_changes(active_script_info_t &active, file_stat_cache_t &stats)
+    {
+        auto &batch = active.batch;
+        bool b_changed = false;
+        const bool with_hash = opt_content_hash != 0;
         do
         {
-            auto script_file = script_info->file_path.c_str();
+            // In trigger file mode, just wait for the trigger file to be created
+            if (active.trigger_based())
+            {
+                // The monitor waits until the trigger file is created or modified
+                auto &trigger_file = active.trigger_file;
+                bool b_fire =     m_filemon.is_changed(trigger_file.file_path)
+                              &&  trigger_file.get_modification_status(true, false, &stats) == filemod_status_e::modified;
+
+                // Loader mode: a new input file runs the loader again too
+                auto &loader_input = active.loader_input;
+                if (     !loader_input.empty()
+                     &&  m_filemon.is_changed(loader_input.file_path)
+                     &&  loader_input.get_modification_status(true, false, &stats) == filemod_status_e::modified)
+                {
+                    b_fire = true;
+                }
+
+                if (b_fire)
+                {
+                    // Always execute the main script even if it was not changed
+                    active.invalidate();
+
+                    // Dependencies changes were not looked at while waiting for the trigger
+                    m_filemon.request_rescan();
+                    batch.b_triggered = b_changed = true;
+                }
+
+                if (!batch.b_triggered)
+                    break;
+                // ...and proceed with qscript logic
+            }
+
+            // Check if the active script or its dependencies are changed:
+            // 1. Dependency file --> repopulate it and execute active script
+            // 2. Any dependencies --> reload if needed and //
+            // 3. Active script --> execute it again
+            // Let's check the dependencies index files first (modified or gone)
+            if (active.get_modified_dep_indices(m_filemon, batch.dep_indices, with_hash, &stats))
+                b_changed = true;
 
-            // First things first: always take the file's modification timestamp first so not to visit it again in the file monitor timer
-            if (!get_file_modification_time(script_file, &script_info->modified_time))
+            //
+            // Check the dependency scripts
+            //
+            for (auto &dep_script: active.dep_scripts)
             {
-                msg("Script file '%s' not found!\n", script_file);
-                break;
+                if (     m_filemon.is_changed(dep_script.file_path)
+                     &&  dep_script.get_modification_status(true, with_hash, &stats) == filemod_status_e::modified)
+                {
+                    batch.dep_scripts.insert(dep_script.file_path.c_str());
+                    b_changed = true;
+                }
             }
 
-            const char *script_ext = get_file_ext(script_file);
-            extlang_object_t elang(nullptr);
-            if (script_ext == nullptr || (elang = find_extlang_by_ext(script_ext)) == nullptr)
+            // Check the main script
+            if (m_filemon.is_changed(active.file_path))
             {
-                msg("Unknown script language detected for '%s'!\n", script_file);
-                break;
+                auto mod_stat = active.get_modification_status(true, with_hash, &stats);
+                if (mod_stat == filemod_status_e::not_found)
+                {
+                    // Script no longer exists
+                    msg("QScripts detected that the active script '%s' no longer exists!\n", active.file_path.c_str());
+                    deactivate_script(active);
+                    return false;
+                }
+                if (mod_stat == filemod_status_e::modified)
+                    batch.b_main_changed = b_changed = true;
             }
+        } while (false);
 
-            if (opt_clear_log)
-                msg_clear();
+        if (b_changed)
+            batch.last_change = std::chrono::steady_clock::now();
+        return true;
+    }
 
-            // Silently call the unload script function
-            qstring errbuf;
-            if (opt_exec_unload_func)
+    // Checks that a changed file is completely written: its time stamp and size did not change
+    // since it was seen changed and no other process has it opened for writing
+    bool is_write_complete(fileinfo_t &fi, bool with_hash)
+    {
+        if (fi.empty())
+            return true;
+
+        // Changed again meanwhile, or gone
+        switch (fi.get_modification_status(true, with_hash))
+        {
+            case filemod_status_e::modified:
+                return false;
+            case filemod_status_e::not_found:
+                return true;
+            default:
+                break;
+        }
+        return is_file_write_complete(fi.file_path.c_str());
+    }
+
+    // Are all the files of a pending batch completely written?
+    bool is_batch_write_complete(active_script_info_t &active)
+    {
+        auto &batch = active.batch;
+        const bool with_hash = opt_content_hash != 0;
+        if (batch.b_triggered && !is_write_complete(active.trigger_file, false))
+            return false;
+
+        if (batch.b_triggered && !is_write_complete(active.loader_input, false))
+            return false;
+
+        if (batch.b_main_changed && !is_write_complete(active, with_hash))
+            return false;
+
+        for (auto &key: batch.dep_indices)
+        {
+            auto p = active.dep_indices.find(key);
+            if (p != active.dep_indices.end() && !is_write_complete(p->second, with_hash))
+                return false;
+        }
+
+        for (auto &key: batch.dep_scripts)
+        {
+            auto dep_script = active.dep_scripts.find(key);
+            if (dep_script != nullptr && !is_write_complete(*dep_script, with_hash))
+                return false;
+        }
+        return true;
+    }
+
+    // Turns the pending batch of an active script into an execution plan: patches the dependencies
+    // graph with the changed index files, then expands the reload directives of the changed dependencies
+    void build_plan(active_script_info_t &active, exec_plan_t &plan)
+    {
+        auto &batch = active.batch;
+        plan.script_file = active.file_path;
+
+        // Delete the trigger file (once it is completely written)
+        if (batch.b_triggered && !active.b_keep_trigger_file)
+            qunlink(active.trigger_file.c_str());
+
+        if (!batch.dep_indices.empty())
+        {
+            // Re-parse only the changed index files and patch the dependencies graph
+            qstrvec_t owners;
+            for (auto &key: batch.dep_indices)
             {
-                idc_value_t result;
-                elang->call_func(&result, UNLOAD_SCRIPT_FUNC_NAME, &result, 0, &errbuf);
+                auto p = active.dep_indices.find(key);
+                if (p != active.dep_indices.end())
+                    owners.push_back(p->second.owner);
             }
+            batch.dep_indices.clear();
 
-            if (opt_show_filename)
-                msg("QScripts executing %s...\n", script_file);
+            // Refresh the UI
+            if (update_deps(active, owners, &batch))
+                plan.b_refresh = true;
 
-            exec_ok = elang->compile_file(script_file, &errbuf);
-            if (!exec_ok)
+            // The cache records the index files time stamps: keep it current
+            save_deps_cache(active);
+        }
+
+        // Reload the changed dependencies and their dependents, in dependency order
+        qstrvec_t reload_order;
+        active.get_reload_order(batch.dep_scripts, reload_order);
+
+        plan.b_execute = batch.b_triggered || batch.b_main_changed || !reload_order.empty();
+        if (batch.b_triggered)
+            plan.trigger_file = active.trigger_file.file_path;
+        for (auto &dep_file: reload_order)
+        {
+            auto dep_script = active.dep_scripts.find(dep_file);
+            if (dep_script == nullptr || !dep_script->has_reload_directive())
+                continue;
+
+            auto &reload = plan.reloads.push_back();
+            reload.script_file = dep_script->file_path;
+            expand_reload_cmd(active, *dep_script, reload.reload_cmd);
+        }
+
+        // A new build of the native plugin
+        if (batch.b_triggered && active.b_native)
+        {
+            plan.native_file  = active.trigger_file.file_path;
+            plan.native_arg   = active.native_arg;
+            plan.loader_input = active.loader_input.file_path;
+        }
+        batch.clear();
+    }
+
+    // Starts or stops the remote trigger channel as per the options ('b_force' starts it regardless)
+    void update_ipc_server(bool b_force = false)
+    {
+        if (!opt_ipc && !b_force)
+        {
+            m_ipc.stop();
+            return;
+        }
+        if (m_ipc.is_running())
+            return;
+
+        qstring endpoint, err;
+        if (!qgetenv(IPC_ENDPOINT_ENV_NAME, &endpoint) || endpoint.empty())
+            ipc_server_t::get_default_endpoint(endpoint);
+
+        auto handler = [this](uint32, const qstring &command, qstring &reply) { handle_ipc_command(command, reply); };
+        if (m_ipc.start(endpoint.c_str(), handler, err))
+            msg("QScripts: accepting remote commands on '%s'\n", endpoint.c_str());
+        else
+            msg("QScripts: failed to start the remote commands channel: %s\n", err.c_str());
+    }
+
+    // Switches the file monitor to or from the shared watcher as per the options
+    void update_shared_watch()
+    {
+        std::lock_guard<std::recursive_mutex> lock(m_mutex);
+        if (m_b_shared_watch == (opt_shared_watch != 0))
+            return;
+
+        m_b_shared_watch = opt_shared_watch != 0;
+        if (!m_b_shared_watch)
+        {
+            request_filemon_backend(create_filemon_backend());
+            return;
+        }
+
+        qstring endpoint;
+        if (!qgetenv(WATCH_ENDPOINT_ENV_NAME, &endpoint) || endpoint.empty())
+            watch_hub_t::get_default_endpoint(endpoint);
+        request_filemon_backend(new filemon_shared_backend_t(endpoint.c_str(), FILEMON_EVENT_INTERVAL, opt_change_interval));
+    }
+
+    // Handles a command of the remote trigger channel (on the channel's thread):
+    //      run                 executes the active script (run argument 1)
+    //      reload <dep>        reloads a dependency (and its dependents) and executes its active scripts
+    //      activate <script>   activates a script and executes it
+    //      monitor on|off      activates or deactivates the monitor (run arguments 2 and 3)
+    //      status              the monitor state, the active script and the last run
+    //      stop                ends the headless watch mode
+    void handle_ipc_command(const qstring &command, qstring &reply)
+    {
+        qstring verb = command, arg;
+        if (const char *sp = strchr(command.c_str(), ' '))
+        {
+            verb = qstring(command.c_str(), sp - command.c_str());
+            arg = sp + 1;
+            arg.trim2();
+        }
+
+        if (verb == "run")
+        {
+            std::lock_guard<std::recursive_mutex> lock(m_mutex);
+            if (!has_selected_script())
             {
-                msg("QScripts failed to compile script file: '%s':\n%s", script_file, errbuf.c_str());
-                break;
+                reply = "error no active script";
+                return;
             }
-
-            // Special case for IDC scripts: we have to call 'main'
-            if (elang->is_idc())
+            request_selected_script_run();
+            reply = "ok";
+        }
+        else if (verb == "reload")
+        {
+            // The monitor plans the reload
+            if (!is_monitor_active())
             {
-                idc_value_t result;
-                exec_ok = elang->call_func(&result, "main", &result, 0, &errbuf);
-                if (!exec_ok)
+                reply = "error the monitor is not active";
+                return;
+            }
+            make_abs_path(arg, nullptr, true);
+            size_t n = request_dep_reload(arg);
+            if (n == 0)
+                reply.sprnt("error '%s' is not a dependency of an active script", arg.c_str());
+            else
+                reply.sprnt("ok %zu", n);
+        }
+        else if (verb == "activate")
+        {
+            make_abs_path(arg, nullptr, true);
+            if (!qfileexist(arg.c_str()))
+            {
+                reply.sprnt("error script file '%s' not found", arg.c_str());
+                return;
+            }
+            post_main_thread_request(new ipc_request_t(m_self, arg.c_str(), 0));
+            reply = "ok";
+        }
+        else if (verb == "monitor" && (arg == "on" || arg == "off"))
+        {
+            post_main_thread_request(new ipc_request_t(m_self, nullptr, arg == "on" ? 2 : 3));
+            reply = "ok";
+        }
+        else if (verb == "stop")
+        {
+            {
+                std::lock_guard<std::mutex> lock(m_headless_mutex);
+                if (!m_b_headless || !m_headless.b_watch)
                 {
-                    msg("QScripts failed to run the IDC main() of file '%s':\n%s", script_file, errbuf.c_str());
-                    break;
+                    reply = "error not watching in headless mode";
+                    return;
                 }
+                m_b_headless_stop = true;
             }
-        } while (false);
-        activate_monitor(old_state);
+            m_headless_cv.notify_one();
+            reply = "ok";
+        }
+        else if (verb == "status")
+        {
+            std::lock_guard<std::recursive_mutex> lock(m_mutex);
+            reply.sprnt("ok monitor=%s running=%d pending=%zu last=%s script=%s",
+                is_monitor_active() ? "on" : "off",
+                m_nrunning != 0 ? 1 : 0,
+                m_pending_plans.size(),
+                m_b_last_run_ok ? "ok" : "failed",
+                selected_script.file_path.c_str());
+        }
+        else
+        {
+            reply.sprnt("error unknown command '%s'", command.c_str());
+        }
+    }
 
-        return exec_ok;
+    // Reloads a dependency as if it changed, without waiting for the debounce interval: the
+    // monitor thread queues the change and plans it as usual. Returns the number of active
+    // scripts depending on it.
+    size_t request_dep_reload(const qstring &dep_file)
+    {
+        size_t n = 0;
+        {
+            std::lock_guard<std::recursive_mutex> lock(m_mutex);
+            for_each_active_script([&](active_script_info_t &active)
+            {
+                if (active.has_dep(dep_file) != nullptr)
+                    ++n;
+            });
+        }
+        if (n == 0)
+            return 0;
+
+        {
+            std::lock_guard<std::mutex> req_lock(m_filemon_req_mutex);
+            m_dep_reload_req.push_back(dep_file);
+        }
+        wake_monitor();
+        return n;
     }
 
-    enum {
-        OPTID_INTERVAL       = 0x0001,
-        OPTID_CLEARLOG       = 0x0002,
-        OPTID_SHOWNAME       = 0x0004,
-        OPTID_UNLOADEXEC     = 0x0008,
-        OPTID_SELSCRIPT      = 0x0010,
-        OPTID_WITHUNDO       = 0x0020,
+    // Activates a script by path and executes it (the remote 'activate' command)
+    void activate_script_file(const char *script_file)
+    {
+        script_info_t script(script_file);
+        if (!script.refresh())
+        {
+            msg("Script file not found: '%s'\n", script_file);
+            return;
+        }
 
-        OPTID_ONLY_SCRIPT    = OPTID_SELSCRIPT,
-        OPTID_ALL_BUT_SCRIPT = 0xffff & ~OPTID_ONLY_SCRIPT,
-        OPTID_ALL            = 0xffff,
-    };
+        set_selected_script(script);
+        reg_update_strlist(IDAREG_RECENT_SCRIPTS, script_file, IDA_MAX_RECENT_SCRIPTS);
+        add_recent_script(script);
+        if (execute_script(&selected_script, opt_with_undo))
+            saveload_options(true, OPTID_ONLY_SCRIPT);
 
-    // Save or load the options
-    void saveload_options(bool bsave, int what_ids = OPTID_ALL)
+        activate_monitor();
+        refresh_chooser(QSCRIPTS_TITLE);
+    }
+
+    // Has the pending plans executed on the main thread (by the headless loop in headless mode)
+    void post_pending_plans()
     {
-        enum { QSTR = 1000 };
-        struct options_t
+        m_b_plan_posted = true;
+        post_main_thread_request(new main_thread_request_t(m_self, &qscripts_chooser_t::execute_pending_plan));
+    }
+
+    // Runs a request on the main thread, without waiting for it: through the UI or, in
+    // headless mode, through the headless loop (the UI requests are not processed there)
+    void post_main_thread_request(exec_request_t *req)
+    {
+        {
+            std::lock_guard<std::mutex> lock(m_headless_mutex);
+            if (m_b_headless)
+            {
+                m_headless_requests.push_back(req);
+                req = nullptr;
+            }
+        }
+        if (req == nullptr)
+            m_headless_cv.notify_one();
+        else
+            execute_sync(*req, MFF_WRITE | MFF_NOWAIT);
+    }
+
+    // Queues a plan for the main thread (merged with the pending plan of the same script).
+    // A plan for the running script cancels it: the newer plan runs once it returns.
+    void post_plan(const exec_plan_t &plan)
+    {
+        if (plan.empty())
+            return;
+
+        if (     m_nrunning != 0
+             &&  (plan.b_execute || !plan.reloads.empty() || !plan.native_file.empty())
+             &&  plan.script_file == m_running_script)
+        {
+            s_b_cancel_run = true;
+        }
+
+        auto p = std::find_if(m_pending_plans.begin(), m_pending_plans.end(),
+            [&plan](const exec_plan_t &pending) { return pending.script_file == plan.script_file; });
+        if (p != m_pending_plans.end())
+            p->merge(plan);
+        else
+            m_pending_plans.push_back(plan);
+
+        if (!m_b_plan_posted)
+        {
+            post_pending_plans();
+        }
+    }
+
+    // Forgets the pending plan of a script
+    void drop_pending_plan(const qstring &script_file)
+    {
+        std::lock_guard<std::recursive_mutex> lock(m_mutex);
+        auto p = std::find_if(m_pending_plans.begin(), m_pending_plans.end(),
+            [&script_file](const exec_plan_t &pending) { return pending.script_file == script_file; });
+        if (p != m_pending_plans.end())
+            m_pending_plans.erase(p);
+    }
+
+    // Runs the pending plans: for each active script, reloads the changed dependencies and
+    // executes the script once
+    void execute_pending_plan()
+    {
+        qvector<exec_plan_t> plans;
+        {
+            std::lock_guard<std::recursive_mutex> lock(m_mutex);
+            m_b_plan_posted = false;
+
+            // A running script is processing the UI events: the plans are posted again when it returns
+            if (m_nrunning != 0)
+                return;
+
+            plans.swap(m_pending_plans);
+
+            // Forget the extra scripts that the monitor deactivated
+            prune_extra_scripts();
+        }
+
+        bool b_refresh = false;
+        for (auto &plan: plans)
+            b_refresh |= plan.b_refresh;
+        if (b_refresh)
+            refresh_chooser(QSCRIPTS_TITLE);
+
+        for (auto &plan: plans)
+            execute_plan(plan);
+    }
+
+    void execute_plan(const exec_plan_t &plan)
+    {
+        active_script_info_t *active;
+        {
+            // Was the script deactivated or switched meanwhile?
+            std::lock_guard<std::recursive_mutex> lock(m_mutex);
+            active = find_active_script(plan.script_file);
+            if (active == nullptr)
+                return;
+        }
+
+        run_profile_t run;
+        run.script_file  = plan.script_file;
+        run.b_monitored  = true;
+        run.trigger_file = plan.trigger_file;
+        run[run_phase_e::detect] = plan.detect_us;
+        run[run_phase_e::parse]  = plan.parse_us;
+
+        // Start from the database state before the previous run
+        if (opt_auto_rollback && (plan.b_execute || !plan.native_file.empty()))
+            rollback_previous_run(plan.script_file);
+
+        if (!execute_reloads(plan, run))
+        {
+            record_run(run);
+            return;
+        }
+
+        // Load and run the new build of the native plugin
+        if (!plan.native_file.empty() && !load_native_plugin(plan, run))
+        {
+            record_run(run);
+            return;
+        }
+
+        // Script or its dependencies changed?
+        if (plan.b_execute)
         {
-            int id;
-            const char *name;
-            int vtype;
-            void *pval;
-        } int_options [] =
+            m_p_run = &run;
+            execute_script(active, opt_with_undo);
+            m_p_run = nullptr;
+        }
+        else
         {
-            {OPTID_INTERVAL,   "QScripts_interval",             VT_LONG, &opt_change_interval},
-            {OPTID_CLEARLOG,   "QScripts_clearlog",             VT_LONG, &opt_clear_log},
-            {OPTID_SHOWNAME,   "QScripts_showscriptname",       VT_LONG, &opt_show_filename},
-            {OPTID_UNLOADEXEC, "QScripts_exec_unload_func",     VT_LONG, &opt_exec_unload_func},
-            {OPTID_SELSCRIPT,  "QScripts_selected_script_name", QSTR, &selected_script.file_path},
-            {OPTID_WITHUNDO,   "QScripts_with_undo",            VT_LONG, &opt_with_undo}
-        };
+            run.b_ok = true;
+        }
+        record_run(run);
+    }
 
-        for (auto &opt: int_options)
+    // The loader mode deletes the database contents: asks once unless the database is temporary
+    bool can_reset_loader_database()
+    {
+        if (is_temp_database())
+            return true;
+        if (m_loader_reset_answer == -1)
         {
-            if ((what_ids & opt.id) == 0)
-                continue;
+            m_loader_reset_answer = ask_yn(
+                ASKBTN_NO,
+                "HIDECANCEL\n"
+                "The loader mode deletes all the segments of the database before each run,\n"
+                "but this database is not a temporary one.\n\n"
+                "Delete the contents of this database anyway?") == ASKBTN_YES;
+        }
+        return m_loader_reset_answer == 1;
+    }
 
-            if (opt.vtype == VT_LONG)
-            {
-                if (bsave)
-                    reg_write_int(opt.name, *(int *)opt.pval);
-                else
-                    *(int *)opt.pval = reg_read_int(opt.name, *(int *)opt.pval);
-            }
-            else if (opt.vtype == VT_STR)
+    // Loads the native plugin of a plan. Returns false if the run should stop.
+    bool load_native_plugin(const exec_plan_t &plan, run_profile_t &run)
+    {
+        qstring err;
+        stopwatch_t sw;
+        if (opt_show_filename)
+            msg("QScripts loading the native plugin %s...\n", plan.native_file.c_str());
+
+        // Loader mode: start over from an empty database and tell the loader what to load
+        if (!plan.loader_input.empty())
+        {
+            if (!can_reset_loader_database())
             {
-                if (bsave)
-                    reg_write_string(opt.name, ((qstring *)opt.pval)->c_str());
-                else
-                    reg_read_string(((qstring *)opt.pval), opt.name);
+                run.error = "the loader mode only runs on a temporary database (start IDA with -t)";
+                msg("QScripts: %s\n", run.error.c_str());
+                return false;
             }
-            else if (opt.vtype == QSTR)
+            size_t nsegs = reset_loader_database();
+            if (opt_show_filename)
+                msg("QScripts deleted %zu segment(s) loaded by the previous run\n", nsegs);
+            qsetenv(LOADER_INPUT_ENV_NAME, plan.loader_input.c_str());
+        }
+
+        begin_run(plan.script_file);
+        auto status = m_native_loader.load_and_run(plan.native_file.c_str(), plan.native_arg, err);
+        end_run();
+        run[run_phase_e::run] += sw.elapsed_us();
+
+        switch (status)
+        {
+            case native_load_e::ok:
+                m_native_copy_failures = 0;
+                return true;
+            case native_load_e::copy_failed:
             {
-                if (bsave)
+                // The build output is most likely still being written: try again on the next scan
+                file_time_t mtime = 0;
+                uint64 size = 0;
+                get_file_modification_time(plan.native_file, &mtime, &size);
+                if (     plan.native_file != m_native_copy_file
+                     ||  mtime != m_native_copy_mtime
+                     ||  size  != m_native_copy_size)
                 {
-                    reg_write_string(opt.name, ((qstring *)opt.pval)->c_str());
+                    m_native_copy_failures = 0;
+                    m_native_copy_file  = plan.native_file;
+                    m_native_copy_mtime = mtime;
+                    m_native_copy_size  = size;
                 }
-                else
+
+                std::lock_guard<std::recursive_mutex> lock(m_mutex);
+                auto active = find_active_script(plan.script_file);
+                if (active != nullptr && ++m_native_copy_failures <= MAX_NATIVE_COPY_RETRIES)
                 {
-                    qstring tmp;
-                    reg_read_string(&tmp, opt.name);
-                    *((qstring *)opt.pval) = tmp.c_str();
+                    ++m_active_gen;
+                    active->trigger_file.invalidate();
+                    request_filemon_rescan();
+                    run.error = err;
+                    return false;
                 }
+
+                // Giving up on this build: the next one gets all its retries
+                m_native_copy_failures = 0;
+                m_native_copy_file.qclear();
+                break;
             }
+            case native_load_e::run_failed:
+                // The plugin ran: go on with the script
+                msg("QScripts: warning: %s\n", err.c_str());
+                return true;
+            default:
+                break;
         }
-
-        if (!bsave)
-            opt_change_interval = normalize_filemon_interval(opt_change_interval);
+        run.error = err;
+        msg("QScripts: %s\n", err.c_str());
+        return false;
     }
 
-    static int idaapi s_filemon_timer_cb(void *ud)
+    // Reads the files reported as changed before they are compared with the active scripts,
+    // so that the comparison holds the lock without reading any file. The files are looked
+    // up under the lock, then stat'ed (and hashed when their metadata changed) outside of it.
+    void prefetch_changes(file_stat_cache_t &stats)
     {
-        return ((qscripts_chooser_t *)ud)->filemon_timer_cb();
+        const bool with_hash = opt_content_hash != 0;
+        qvector<fileinfo_t> files;
+        {
+            std::lock_guard<std::recursive_mutex> lock(m_mutex);
+            auto add_file = [&](fileinfo_t &fi, bool b_hash)
+            {
+                if (fi.empty() || !m_filemon.is_changed(fi.file_path))
+                    return;
+
+                // Already read by a full rescan: only the hash may be missing
+                auto st = stats.peek(fi.file_path, &fi.stat_id);
+                if (     st == nullptr
+                     || (     b_hash
+                          &&  st->exists
+                          && !st->b_hash_done
+                          &&  (st->mtime != fi.modified_time || st->size != fi.file_size)))
+                {
+                    files.push_back(fi);
+                }
+            };
+            for_each_active_script([&](active_script_info_t &active)
+            {
+                add_file(active.trigger_file, false);
+                add_file(active.loader_input, false);
+                add_file(active, with_hash);
+                for (auto &kv: active.dep_indices)
+                    add_file(kv.second, with_hash);
+                for (auto &dep_script: active.dep_scripts)
+                    add_file(dep_script, with_hash);
+            });
+        }
+
+        // The copies are compared instead: this fills the scan's records
+        for (auto &fi: files)
+            fi.get_modification_status(true, with_hash, &stats);
     }
 
-    // Monitor callback
-    int filemon_timer_cb()
+    // Checks that the files of a batch past its debounce interval are completely written,
+    // then turns it into a plan. The files are read and the index files parsed on a copy
+    // of the active script, outside of the lock; the results are dropped if the active
+    // script changed meanwhile (the batch is then looked at again on the next tick).
+    // Returns the number of milliseconds until the batch should be looked at again.
+    int plan_due_batch(const qstring &script_file)
     {
-        do
+        active_script_info_t work;
+        uint32 gen;
         {
-            // No active script, do nothing
-            if (!is_monitor_active() || !has_selected_script())
-                break;
+            std::lock_guard<std::recursive_mutex> lock(m_mutex);
+            auto active = find_active_script(script_file);
+            if (active == nullptr || active->batch.empty())
+                return INACTIVE_MONITOR_INTERVAL;
+            work = *active;
+            gen = m_active_gen;
+        }
 
-            // In trigger file mode, just wait for the trigger file to be created
-            if (selected_script.trigger_based())
+        int next_interval = INACTIVE_MONITOR_INTERVAL;
+        exec_plan_t plan;
+        auto &batch = work.batch;
+        bool b_ready = true;
+
+        // Wait until the changed files are completely written
+        if (opt_wait_writes && !is_batch_write_complete(work))
+        {
+            auto now = std::chrono::steady_clock::now();
+            if (!batch.b_waiting_writes)
             {
-                // The monitor waits until the trigger file is created or modified
-                auto trigger_status = selected_script.trigger_file.get_modification_status(true);
-                if (trigger_status != filemod_status_e::modified)
-                    break;
+                batch.b_waiting_writes = true;
+                batch.wait_start = now;
+            }
+            if (now - batch.wait_start < std::chrono::milliseconds(WRITE_COMPLETE_TIMEOUT))
+            {
+                batch.last_change = now;
+                next_interval = qmax(opt_debounce_interval, FILEMON_EVENT_INTERVAL);
+                b_ready = false;
+            }
+            else
+            {
+                msg("QScripts: '%s' still has files being written, executing anyway\n", work.file_path.c_str());
+            }
+        }
 
-                // Delete the trigger file
-                if (!selected_script.b_keep_trigger_file)
-                    qunlink(selected_script.trigger_file.c_str());
+        if (b_ready)
+        {
+            plan.detect_us = batch.detect_us;
+            stopwatch_t parse_sw;
+            build_plan(work, plan);
+            plan.parse_us = parse_sw.elapsed_us();
+        }
 
-                // Always execute the main script even if it was not changed
-                selected_script.invalidate();
-                // ...and proceed with qscript logic
-            }
+        std::lock_guard<std::recursive_mutex> lock(m_mutex);
+        auto active = find_active_script(script_file);
+        if (active == nullptr)
+            return INACTIVE_MONITOR_INTERVAL;
+        if (gen != m_active_gen)
+            return FILEMON_EVENT_INTERVAL;
 
-            // Check if the active script or its dependencies are changed:
-            // 1. Dependency file --> repopulate it and execute active script
-            // 2. Any dependencies --> reload if needed and //
-            // 3. Active script --> execute it again
-            auto &dep_scripts = selected_script.dep_scripts;
+        active->update_from(std::move(work));
+        if (b_ready)
+        {
+            update_filemon_watch();
+            post_plan(plan);
+        }
+        return next_interval;
+    }
 
-            // Let's check the dependencies index files first
-            auto mod_stat = selected_script.is_any_dep_index_modified();
-            if (mod_stat == filemod_status_e::modified)
-            {
-                // Force re-parsing of the index file
-                dep_scripts.clear();
-                set_selected_script(selected_script);
+    // Monitor callback, called from the monitor thread.
+    // Returns the number of milliseconds until the next call.
+    int filemon_timer_cb()
+    {
+        apply_filemon_requests();
 
-                // Let's invalidate all the scripts time stamps so we ensure they are re-interpreted again
-                selected_script.invalidate_all_scripts();
+        // No active script, do nothing (until the monitor is woken up)
+        if (!is_monitor_active() || !has_active_scripts())
+            return INACTIVE_MONITOR_INTERVAL;
 
-                // Refresh the UI
-                refresh_chooser(QSCRIPTS_TITLE);
+        int next_interval = INACTIVE_MONITOR_INTERVAL;
 
-                // Just leave and come back fast so we get a chance to re-evaluate everything
-                return 1; // (1 ms)
-            }
-            // Dependency index file is gone
-            else if (mod_stat == filemod_status_e::not_found && !dep_scripts.empty())
+        // Gather what changed in the watched directories and hand the changes to every
+        // active script depending on them. Shared files are only stat'ed once.
+        stopwatch_t sw;
+        bool b_gone = false;
+        if (m_filemon.poll())
+        {
+            auto &stats = m_filemon.scan();
+            prefetch_changes(stats);
+
+            std::lock_guard<std::recursive_mutex> lock(m_mutex);
+            for_each_active_script([&](active_script_info_t &active)
             {
-                // Let's just check the active script
-                dep_scripts.clear();
-            }
+                if (!collect_changes(active, stats))
+                    b_gone = true;
+            });
+            m_filemon.done();
+
+            // The watch set of the remaining scripts changed: keep the rescan it requested
+            if (b_gone)
+                m_filemon.request_rescan();
+        }
+        uint64 detect_us = sw.elapsed_us();
 
-            //
-            // Check the dependency scripts
-            //
-            bool dep_script_changed = false;
-            bool brk = false;
-            for (auto &kv: dep_scripts)
+        // The batches past their debounce interval
+        qstrvec_t due;
+        bool b_activity = b_gone;
+        {
+            std::lock_guard<std::recursive_mutex> lock(m_mutex);
+            if (b_gone)
             {
-                auto &dep_script = kv.second;
-                if (dep_script.get_modification_status() == filemod_status_e::modified)
-                {
-                    qstring err;
-                    dep_script_changed = true;
-                    if (     dep_script.has_reload_directive()
-                         && !execute_reload_directive(dep_script, err))
-                    {
-                        msg("QScripts: warning: failed to execute reload directive: %s\n", err.c_str());
-                        brk = true;
-                        break;
-                    }
-                }
+                exec_plan_t plan;
+                plan.b_refresh = true;
+                post_plan(plan);
             }
-            if (brk)
-                break;
 
-            // Check the main script
-            if ((mod_stat = selected_script.get_modification_status()) == filemod_status_e::not_found)
+            for_each_active_script([&](active_script_info_t &active)
             {
-                // Script no longer exists
-                msg("QScripts detected that the active script '%s' no longer exists!\n", get_selected_script_file());
-                clear_selected_script();
-                break;
-            }
+                auto &batch = active.batch;
+                if (batch.empty())
+                    return;
+                b_activity = true;
+                batch.detect_us += detect_us;
+
+                // Wait until the changes settle down
+                int remaining = batch.remaining_ms(opt_debounce_interval);
+                if (remaining > 0)
+                    next_interval = qmin(next_interval, remaining);
+                else
+                    due.push_back(active.file_path);
+            });
+        }
 
-            // Script or its dependencies changed?
-            if (dep_script_changed || mod_stat == filemod_status_e::modified)
-                execute_script(&selected_script, opt_with_undo);
-        } while (false);
-        return opt_change_interval;
+        for (auto &script_file: due)
+            next_interval = qmin(next_interval, plan_due_batch(script_file));
+
+        int interval;
+        if (m_filemon.is_polling())
+            interval = get_poll_interval(b_activity);
+        else if (m_filemon.has_lost_dirs())
+            interval = FILEMON_LOST_DIR_INTERVAL;
+        else if (m_filemon.event_fd() != -1)
+            interval = INACTIVE_MONITOR_INTERVAL;   // Woken up by the events
+        else
+            interval = FILEMON_EVENT_INTERVAL;
+        return qmin(next_interval, interval);
     }
 
 protected:
@@ -723,48 +3404,163 @@ protected:
         CH_KEEP    | CH_RESTORE  | CH_ATTRS   |
         CH_CAN_DEL | CH_CAN_EDIT | CH_CAN_INS | CH_CAN_REFRESH;
 
-    static constexpr int widths_[2]               = { 20, 70 };
-    static constexpr const char *const header_[2] = { "Script", "Path" };
+    // The timing columns show the last run of a script, or the last reload time of a dependency
+    static constexpr int widths_[9]               = { 20, 70, 8, 6, 6, 6, 6, 6, 6 };
+    static constexpr const char *const header_[9] = { "Script", "Path", "Last run (ms)", "Detect", "Parse", "Reload", "Unload", "Compile", "Run" };
 
     static constexpr const char *ACTION_DEACTIVATE_MONITOR_ID        = "qscripts:deactivatemonitor";
     static constexpr const char *ACTION_EXECUTE_SELECTED_SCRIPT_ID   = "qscripts:execselscript";
     static constexpr const char *ACTION_EXECUTE_SCRIPT_WITH_UNDO_ID  = "qscripts:execscriptwithundo";
+    static constexpr const char *ACTION_TOGGLE_EXTRA_SCRIPT_ID       = "qscripts:toggleextrascript";
 
+    // The recent scripts list and the index of each script path in it (main thread only)
     scripts_info_t m_scripts;
+    std::unordered_map<std::string, size_t> m_script_index;
     ssize_t m_nselected = NO_SELECTION;
 
+    // The recent scripts are listed right away and their existence is checked in the
+    // background (network paths can be slow): the stat thread takes the queued paths and
+    // its results are applied to the list on the main thread.
+    struct script_stat_t
+    {
+        qstring file_path;
+        bool b_exists;
+        file_time_t modified_time;
+        uint64 file_size;
+    };
+    std::thread m_stat_thread;
+    std::mutex m_stat_mutex;
+    std::condition_variable m_stat_cv;
+    bool m_b_stop_stat = false;
+    qstrvec_t m_stat_queue;
+    qvector<script_stat_t> m_stat_results;
+    bool m_b_stat_posted = false;
+
     static bool is_correct_widget(action_update_ctx_t* ctx)
     {
         return ctx->widget_title == QSCRIPTS_TITLE;
     }
 
 
-    // Add a new script file and properly populate its script info object
-    // and returns a borrowed reference
-    const script_info_t *add_script(
-        const char *script_file,
-        bool silent = false,
-        bool unique = true)
+    // Rebuilds the path index of the scripts list and finds the active script in it
+    void reindex_scripts()
+    {
+        m_script_index.clear();
+        m_nselected = NO_SELECTION;
+
+        bool b_has_selected_script = has_selected_script();
+        for (size_t i = 0; i < m_scripts.size(); ++i)
+        {
+            auto &script_file = m_scripts[i].file_path;
+            m_script_index.emplace(script_file.c_str(), i);
+            if (b_has_selected_script && script_file == selected_script.file_path)
+                m_nselected = ssize_t(i);
+        }
+    }
+
+    ssize_t find_script_index(const char *script_file) const
+    {
+        auto p = m_script_index.find(script_file);
+        return p == m_script_index.end() ? NO_SELECTION : ssize_t(p->second);
+    }
+
+    // Queues the existence check of the given scripts
+    void queue_script_stats(qstrvec_t &script_files)
     {
-        if (unique)
+        if (script_files.empty())
+            return;
+
         {
-            auto p = m_scripts.find({ script_file });
-            if (p != m_scripts.end())
-                return &*p;
+            std::lock_guard<std::mutex> lock(m_stat_mutex);
+            if (m_stat_queue.empty())
+                m_stat_queue.swap(script_files);
+            else
+                m_stat_queue.insert(m_stat_queue.end(), script_files.begin(), script_files.end());
         }
+        m_stat_cv.notify_one();
+    }
 
-        qtime64_t mtime;
-        if (!get_file_modification_time(script_file, &mtime))
+    void stat_thread_proc()
+    {
+        std::unique_lock<std::mutex> lock(m_stat_mutex);
+        while (true)
         {
-            if (!silent)
-                msg("Script file not found: '%s'\n", script_file);
-            return nullptr;
+            m_stat_cv.wait(lock, [this] { return m_b_stop_stat || !m_stat_queue.empty(); });
+            if (m_b_stop_stat)
+                break;
+
+            qstrvec_t batch;
+            batch.swap(m_stat_queue);
+            lock.unlock();
+
+            for (auto &script_file: batch)
+            {
+                script_stat_t st;
+                st.file_path = script_file;
+                st.b_exists  = get_file_modification_time(script_file, &st.modified_time, &st.file_size);
+
+                lock.lock();
+                bool b_stop = m_b_stop_stat;
+                m_stat_results.push_back(std::move(st));
+                bool b_post = !m_b_stat_posted;
+                m_b_stat_posted = true;
+                lock.unlock();
+
+                if (b_stop)
+                    break;
+
+                // A single request in flight takes all the results gathered until it runs
+                if (b_post)
+                    execute_sync(*new main_thread_request_t(m_self, &qscripts_chooser_t::apply_script_stats), MFF_FAST | MFF_NOWAIT);
+            }
+            lock.lock();
+        }
+    }
+
+    // Drops the scripts found missing and refreshes the list if needed (main thread)
+    void apply_script_stats()
+    {
+        qvector<script_stat_t> results;
+        {
+            std::lock_guard<std::mutex> lock(m_stat_mutex);
+            results.swap(m_stat_results);
+            m_b_stat_posted = false;
+        }
+
+        std::lock_guard<std::recursive_mutex> lock(m_mutex);
+        bool b_removed = false;
+        for (auto &st: results)
+        {
+            ssize_t idx = find_script_index(st.file_path.c_str());
+            if (idx == NO_SELECTION)
+                continue;
+
+            auto &si = m_scripts[idx];
+            if (st.b_exists)
+            {
+                si.modified_time = st.modified_time;
+                si.file_size     = st.file_size;
+            }
+            else
+            {
+                // Marked for removal
+                si.file_path.clear();
+                b_removed = true;
+            }
         }
 
-        auto &si         = m_scripts.push_back();
-        si.file_path     = script_file;
-        si.modified_time = mtime;
-        return &si;
+        if (b_removed)
+        {
+            size_t n = 0;
+            for (auto &si: m_scripts)
+            {
+                if (!si.file_path.empty())
+                    m_scripts[n++] = std::move(si);
+            }
+            m_scripts.resize(n);
+            reindex_scripts();
+            refresh_chooser(QSCRIPTS_TITLE);
+        }
     }
 
     bool config_dialog()
@@ -772,11 +3568,20 @@ protected:
         static const char form[] =
             "Options\n"
             "\n"
-            "<#Controls the refresh rate of the script change monitor#Script monitor ~i~nterval:D:100:10::>\n"
+            "<#Controls the refresh rate of the script change monitor (when polling, the fastest one: it backs off while nothing changes)#Script monitor ~i~nterval:D:100:10::>\n"
+            "<#Changes seen within this window are executed together only once#De~b~ounce interval:D:100:10::>\n"
             "<#Clear the output window before re-running the script#C~l~ear the output window:C>\n"
             "<#Display the name of the file that is automatically executed#Show ~f~ile name when execution:C>\n"
             "<#Execute a function called '__quick_unload_script' before reloading the script#Execute the u~n~load script function:C>\n"
-            "<#The executed scripts' side effects can be reverted with IDA's Undo#Allow QScripts execution to be ~u~ndo-able:C>>\n"
+            "<#The executed scripts' side effects can be reverted with IDA's Undo#Allow QScripts execution to be ~u~ndo-able:C>\n"
+            "<#Compare the file contents when a time stamp changes and skip saves that did not change anything#Skip unchanged ~c~ontents:C>\n"
+            "<#Append the timings of each run to qscripts_runs.csv in the IDA user directory#Log the run ti~m~ings:C>\n"
+            "<#Save the resolved dependencies next to the root index file and reuse them while the index files are unchanged#C~a~che the dependencies graph:C>\n"
+            "<#Wait until the changed files and the trigger file are no longer being written before executing#~W~ait for the writes to complete:C>\n"
+            "<#Undo the previous run's changes to the database before each run, so that every run starts from the same state#~R~oll back the previous run before each run:C>\n"
+            "<#Listen for the run, reload, activate and status commands of external tools on a local socket (a named pipe on MS Windows)#Accept r~e~mote commands:C>\n"
+            "<#Write the result of each run to <script>.result.json, replaced atomically#Write the run results to a ~J~SON file:C>\n"
+            "<#Let a single IDA instance watch the scripts of all the instances that enable this option, and broadcast the changes to them#S~h~are the file watcher between instances:C>>\n"
                                                                                   
             "\n"
             "\n";
@@ -791,6 +3596,14 @@ protected:
                 ushort b_show_filename    : 1;
                 ushort b_exec_unload_func : 1;
                 ushort b_with_undo        : 1;
+                ushort b_content_hash     : 1;
+                ushort b_run_log          : 1;
+                ushort b_deps_cache       : 1;
+                ushort b_wait_writes      : 1;
+                ushort b_auto_rollback    : 1;
+                ushort b_ipc              : 1;
+                ushort b_result_file      : 1;
+                ushort b_shared_watch     : 1;
             };
         } chk_opts;
         // Load previous options first (account for multiple instances of IDA)
@@ -801,19 +3614,39 @@ protected:
         chk_opts.b_show_filename    = opt_show_filename;
         chk_opts.b_exec_unload_func = opt_exec_unload_func;
         chk_opts.b_with_undo        = opt_with_undo;
+        chk_opts.b_content_hash     = opt_content_hash;
+        chk_opts.b_run_log          = opt_run_log;
+        chk_opts.b_deps_cache       = opt_deps_cache;
+        chk_opts.b_wait_writes      = opt_wait_writes;
+        chk_opts.b_auto_rollback    = opt_auto_rollback;
+        chk_opts.b_ipc              = opt_ipc;
+        chk_opts.b_result_file      = opt_result_file;
+        chk_opts.b_shared_watch     = opt_shared_watch;
         sval_t interval             = opt_change_interval;
+        sval_t debounce             = opt_debounce_interval;
 
-        if (ask_form(form, &interval, &chk_opts.n) > 0)
+        if (ask_form(form, &interval, &debounce, &chk_opts.n) > 0)
         {
             // Copy values from the dialog
-            opt_change_interval  = normalize_filemon_interval(int(interval));
+            opt_change_interval   = normalize_filemon_interval(int(interval));
+            opt_debounce_interval = normalize_debounce_interval(int(debounce));
             opt_clear_log        = chk_opts.b_clear_log;
             opt_show_filename    = chk_opts.b_show_filename;
             opt_exec_unload_func = chk_opts.b_exec_unload_func;
             opt_with_undo        = chk_opts.b_with_undo;
+            opt_content_hash     = chk_opts.b_content_hash;
+            opt_run_log          = chk_opts.b_run_log;
+            opt_deps_cache       = chk_opts.b_deps_cache;
+            opt_wait_writes      = chk_opts.b_wait_writes;
+            opt_auto_rollback    = chk_opts.b_auto_rollback;
+            opt_ipc              = chk_opts.b_ipc;
+            opt_result_file      = chk_opts.b_result_file;
+            opt_shared_watch     = chk_opts.b_shared_watch;
 
             // Save the options directly
             saveload_options(true);
+            update_ipc_server();
+            update_shared_watch();
             return true;
         }
         return false;
@@ -837,12 +3670,25 @@ protected:
         chooser_item_attrs_t *attrs,
         size_t n) const override
     {
+        std::lock_guard<std::recursive_mutex> lock(m_mutex);
         auto si = &m_scripts[n];
         auto path = si->file_path.c_str();
         auto name = strrchr(path, DIRCHAR);
         cols->at(0) = name == nullptr ? path : name + 1;
         cols->at(1) = path;
-        if (n == m_nselected)
+
+        auto fmt_ms = [](qstring &col, uint64 us) { col.sprnt("%.1f", us / 1000.0); };
+        if (auto run = m_run_history.last_run_of(si->file_path))
+        {
+            fmt_ms(cols->at(2), run->total_us());
+            for (size_t i = 0; i < size_t(run_phase_e::count); ++i)
+                fmt_ms(cols->at(3 + i), run->phase_us[i]);
+        }
+        else if (auto reload = m_run_history.last_reload_of(si->file_path))
+        {
+            fmt_ms(cols->at(3 + size_t(run_phase_e::reload)), reload->us);
+        }
+        if (n == m_nselected || is_extra_script(si->file_path))
         {
             if (is_monitor_active())
             {
@@ -855,7 +3701,7 @@ protected:
                 *icon = IDAICONS::RED_DOT;
             }
         }
-        else if (is_monitor_active() && selected_script.has_dep(si->file_path) != nullptr)
+        else if (is_monitor_active() && has_active_dep(si->file_path) != nullptr)
         {
             // Mark as a dependency
             *icon = IDAICONS::EYE_GLASSES_EDIT;
@@ -886,27 +3732,44 @@ protected:
     // Add a new script
     cbret_t idaapi ins(ssize_t) override
     {
-        qstring filter;
-        get_browse_scripts_filter(filter);
-        const char *script_file = ask_file(false, "", "%s", filter.c_str());
+        const char *script_file = ask_file(false, "", "%s", m_extlangs.browse_filter().c_str());
         if (script_file == nullptr)
             return {};
 
+        // The user just picked the file: no need to check it in the background
+        script_info_t si(script_file);
+        if (!si.refresh())
+        {
+            msg("Script file not found: '%s'\n", script_file);
+            return {};
+        }
+
         reg_update_strlist(IDAREG_RECENT_SCRIPTS, script_file, IDA_MAX_RECENT_SCRIPTS);
-        ssize_t idx = build_scripts_list(script_file);
-        return cbret_t(qmax(idx, 0), chooser_base_t::ALL_CHANGED);
+        add_recent_script(si);
+        return cbret_t(0, chooser_base_t::ALL_CHANGED);
     }
 
     // Remove a script from the list
     cbret_t idaapi del(size_t n) override
     {
-        auto &script_file = m_scripts[n].file_path;
+        qstring script_file = m_scripts[n].file_path;
         reg_update_strlist(IDAREG_RECENT_SCRIPTS, nullptr, IDA_MAX_RECENT_SCRIPTS, script_file.c_str());
-        build_scripts_list();
+        {
+            std::lock_guard<std::recursive_mutex> lock(m_mutex);
+            m_scripts.erase(m_scripts.begin() + n);
+            reindex_scripts();
+        }
 
         // Active script removed?
         if (m_nselected == NO_SELECTION)
-            clear_selected_script();
+            deactivate_script(selected_script);
+
+        if (auto extra = find_extra_script(script_file))
+        {
+            deactivate_script(*extra);
+            prune_extra_scripts();
+            save_extra_scripts();
+        }
 
         return adjust_last_item(n);
     }
@@ -923,29 +3786,6 @@ protected:
         saveload_options(true);
     }
 
-    static void get_browse_scripts_filter(qstring &filter)
-    {
-        // Collect all installed external languages
-        extlangs_t langs;
-        collect_extlangs(&langs, false);
-
-        // Build the filter
-        filter = "FILTER Script files|";
-
-        for (auto lang: langs)
-            filter.cat_sprnt("*.%s;", lang->fileext);
-
-        filter.remove_last();
-        filter.append("|");
-
-        // Language specific filters
-        for (auto lang: langs)
-            filter.cat_sprnt("%s scripts|*.%s|", lang->name, lang->fileext);
-
-        filter.remove_last();
-        filter.append("\nSelect script file to load");
-    }
-
     void setup_ui()
     {
         am.add_action(
@@ -986,16 +3826,37 @@ protected:
             "Execute script without activating it",
             IDAICONS::FLASH);
 
+        am.add_action(
+            AMAHF_NONE,
+            ACTION_TOGGLE_EXTRA_SCRIPT_ID,
+            "Activate/deactivate as an additional script",
+            "Ctrl+Enter",
+            FO_ACTION_UPDATE([this],
+                if (!this->is_correct_widget(ctx))
+                    return AST_DISABLE_FOR_WIDGET;
+                else
+                    return ctx->chooser_selection.empty() ? AST_DISABLE : AST_ENABLE;
+            ),
+            FO_ACTION_ACTIVATE([this]) {
+                if (!ctx->chooser_selection.empty())
+                    this->toggle_extra_script_at(ctx->chooser_selection.at(0));
+                return 1;
+            },
+            "Monitor this script too, along with the active script",
+            IDAICONS::FLASH_EDIT);
+
         am.add_action(
             AMAHF_NONE,
             ACTION_EXECUTE_SCRIPT_WITH_UNDO_ID,
             "QScripts monitor: execute last active script",
             "Alt-Shift-X",
             FO_ACTION_UPDATE([this],
-                return this->has_selected_script() ? AST_ENABLE : AST_DISABLE;
+                return this->m_p_undo_script != nullptr || this->has_selected_script() ? AST_ENABLE : AST_DISABLE;
             ),
             FO_ACTION_ACTIVATE([this]) {
-                if (this->has_selected_script())
+                if (this->m_p_undo_script != nullptr)
+                    this->execute_script_sync(this->m_p_undo_script);
+                else if (this->has_selected_script())
                     this->execute_script_sync(&selected_script);
                 return 1;
             },
@@ -1007,53 +3868,75 @@ public:
     static constexpr const char *QSCRIPTS_TITLE = "QScripts";
 
     qscripts_chooser_t(const char *title_ = QSCRIPTS_TITLE)
-        : chooser_t(flags_, qnumber(widths_), widths_, header_, title_), am(this)
+        : chooser_t(flags_, qnumber(widths_), widths_, header_, title_), am(this),
+          m_self(std::make_shared<qscripts_chooser_t *>(this))
     {
         popup_names[POPUP_EDIT] = "~O~ptions";
-        setup_ui();
+#ifndef QSCRIPTS_BENCH
+        // The headless mode has no UI
+        if (!m_headless.load(get_plugin_options("qscripts"), !is_idaq()))
+            setup_ui();
+#endif
     }
 
     bool activate_monitor(bool activate = true)
     {
-        bool old = m_b_filemon_timer_active;
-        m_b_filemon_timer_active = activate;
+        // The monitor also needs to see the newly active scripts without delay while it idles
+        bool old = m_b_filemon_timer_active.exchange(activate);
+        if (activate)
+        {
+            m_b_poll_reset = true;
+            wake_monitor();
+        }
         return old;
     }
 
-    // Rebuilds the scripts list and returns the index of the `find_script` if needed
+    // Rebuilds the scripts list from the registry and returns the index of the `find_script` if needed.
+    // The scripts are listed as is: the missing ones are dropped once the stat thread checked them.
     ssize_t build_scripts_list(const char *find_script = nullptr)
     {
-        // Remember active script and invalidate its index
-        bool b_has_selected_script = has_selected_script();
-        qstring selected_script;
-        if (b_has_selected_script)
-            selected_script = get_selected_script_file();
-
-        // De-selected the current script in the hope of finding it again in the list
-        m_nselected = NO_SELECTION;
+        std::lock_guard<std::recursive_mutex> lock(m_mutex);
 
         // Read all scripts
         qstrvec_t scripts_list;
         reg_read_strlist(&scripts_list, IDAREG_RECENT_SCRIPTS);
 
-        // Rebuild the list
-        ssize_t idx = 0, find_idx = NO_SELECTION;
-        m_scripts.qclear();
+        // Rebuild the list, keeping what is already known about the listed scripts
+        scripts_info_t old_scripts;
+        old_scripts.swap(m_scripts);
+        auto old_index = std::move(m_script_index);
+        m_script_index.clear();
+
+        qstrvec_t to_stat;
         for (auto &script_file: scripts_list)
         {
-            // Restore active script
-            if (b_has_selected_script && selected_script == script_file)
-                m_nselected = idx;
-
-            // Optionally, find the index of a script by name
-            if (find_script != nullptr && streq(script_file.c_str(), find_script))
-                find_idx = idx;
+            if (!m_script_index.emplace(script_file.c_str(), m_scripts.size()).second)
+                continue;
 
-            // We skip non-existent scripts
-            if (add_script(script_file.c_str(), true) != nullptr)
-                ++idx;
+            auto p = old_index.find(script_file.c_str());
+            if (p != old_index.end())
+                m_scripts.push_back(std::move(old_scripts[p->second]));
+            else
+                m_scripts.push_back(script_info_t(script_file.c_str()));
+            to_stat.push_back(script_file);
         }
-        return find_idx;
+        reindex_scripts();
+        queue_script_stats(to_stat);
+
+        return find_script == nullptr ? NO_SELECTION : find_script_index(find_script);
+    }
+
+    // Moves (or adds) a script to the top of the list, as reg_update_strlist() does in the registry
+    void add_recent_script(const script_info_t &si)
+    {
+        std::lock_guard<std::recursive_mutex> lock(m_mutex);
+        ssize_t idx = find_script_index(si.file_path.c_str());
+        if (idx != NO_SELECTION)
+            m_scripts.erase(m_scripts.begin() + idx);
+        m_scripts.insert(m_scripts.begin(), si);
+        if (m_scripts.size() > IDA_MAX_RECENT_SCRIPTS)
+            m_scripts.resize(IDA_MAX_RECENT_SCRIPTS);
+        reindex_scripts();
     }
 
     void execute_last_selected_script(bool with_undo=false)
@@ -1062,6 +3945,34 @@ public:
             execute_script(&selected_script, with_undo);
     }
 
+    // Queues an execution of the active script on the main thread. Requests made before it runs
+    // are coalesced into a single run, and a request made while it runs cancels the running one.
+    void request_selected_script_run()
+    {
+        std::lock_guard<std::recursive_mutex> lock(m_mutex);
+        if (!has_selected_script())
+            return;
+
+        exec_plan_t plan;
+        plan.script_file = selected_script.file_path;
+        plan.b_execute   = true;
+        post_plan(plan);
+    }
+
+    // Activates an additional script and executes it (or deactivates it)
+    void toggle_extra_script_at(ssize_t n)
+    {
+        if (n < 0 || n >= ssize_t(m_scripts.size()))
+            return;
+
+        if (auto active = toggle_extra_script(m_scripts[n]))
+        {
+            execute_script(active, opt_with_undo);
+            activate_monitor();
+        }
+        refresh_chooser(QSCRIPTS_TITLE);
+    }
+
     void execute_script_at(ssize_t n)
     {
         if (n >=0 && n < ssize_t(m_scripts.size()))
@@ -1085,6 +3996,10 @@ public:
                 widget,
                 nullptr,
                 ACTION_EXECUTE_SELECTED_SCRIPT_ID);
+            attach_action_to_popup(
+                widget,
+                nullptr,
+                ACTION_TOGGLE_EXTRA_SCRIPT_ID);
         }
     }
 
@@ -1093,23 +4008,65 @@ public:
         // Load the options
         saveload_options(false);
 
-        // Register the monitor
+        // Let the scripts know when they were cancelled by a newer change and keep their stages
+        for (auto &func: idc_funcs)
+            add_idc_func(func);
+
+        // Keep the extlangs cache current
+        hook_to_notification_point(HT_UI, ui_callback, this);
+
+        // Listen for the remote commands and share the file watcher
+        update_ipc_server();
+        update_shared_watch();
+
+        // Start the monitor thread and the recent scripts' stat thread
         m_b_filemon_timer_active = false;
-        m_filemon_timer = register_timer(
-            opt_change_interval,
-            s_filemon_timer_cb,
-            this);
-        return m_filemon_timer != nullptr;
+        m_b_stop_monitor = false;
+        m_b_stop_stat = false;
+        try
+        {
+            m_filemon_thread = std::thread(&qscripts_chooser_t::filemon_thread_proc, this);
+            m_stat_thread    = std::thread(&qscripts_chooser_t::stat_thread_proc, this);
+        }
+        catch (const std::system_error &)
+        {
+            return false;
+        }
+        return true;
     }
 
     void stop_monitor()
     {
-        if (m_filemon_timer != nullptr)
+        m_ipc.stop();
+
+        if (m_filemon_thread.joinable())
         {
-            unregister_timer(m_filemon_timer);
-            m_filemon_timer = nullptr;
+            m_b_stop_monitor = true;
+            wake_monitor();
+            m_filemon_thread.join();
             m_b_filemon_timer_active = false;
         }
+
+        // Let another instance take over the shared watcher right away
+        {
+            std::lock_guard<std::mutex> req_lock(m_filemon_req_mutex);
+            m_backend_req.reset();
+        }
+        if (m_b_shared_watch)
+        {
+            m_filemon.set_backend(create_filemon_backend());
+            m_b_shared_watch = false;
+        }
+
+        if (m_stat_thread.joinable())
+        {
+            {
+                std::lock_guard<std::mutex> lock(m_stat_mutex);
+                m_b_stop_stat = true;
+            }
+            m_stat_cv.notify_one();
+            m_stat_thread.join();
+        }
     }
 
     bool idaapi run(size_t arg) override
@@ -1122,15 +4079,17 @@ public:
                 show();
                 break;
             }
-            // Execute the selected script
+            // Queue an execution of the selected script
             case 1:
             {
-                execute_last_selected_script();
+                request_selected_script_run();
                 break;
             }
             // Activate the scripts monitor
             case 2:
             {
+                restore_extra_scripts();
+                update_filemon_watch();
                 activate_monitor(true);
                 refresh_chooser(QSCRIPTS_TITLE);
                 break;
@@ -1142,6 +4101,18 @@ public:
                 refresh_chooser(QSCRIPTS_TITLE);
                 break;
             }
+            // Headless mode (for batch scripts), with the options of the plugin or the environment
+            case 4:
+            {
+                // In an interactive session, IDA keeps running
+                if (!m_headless.is_enabled() && m_headless.error.empty())
+                {
+                    msg("QScripts: headless: no script given (see the 'script' plugin option or the QSCRIPTS_HEADLESS_SCRIPT environment variable)\n");
+                    break;
+                }
+                qexit(run_headless());
+                break;
+            }
         }
 
         return true;
@@ -1150,10 +4121,20 @@ public:
     virtual ~qscripts_chooser_t()
     {
         stop_monitor();
+        for (auto &func: idc_funcs)
+            del_idc_func(func.name);
+        unhook_from_notification_point(HT_UI, ui_callback, this);
+
+        // Release the extlangs while their plugins are still loaded
+        m_extlangs.invalidate();
+
+        // Drop the plans that were not executed yet
+        *m_self = nullptr;
     }
 };
 
 //-------------------------------------------------------------------------
+#ifndef QSCRIPTS_BENCH
 plugmod_t *idaapi init(void)
 {
     auto plg = new qscripts_chooser_t();
@@ -1201,3 +4182,4 @@ plugin_t PLUGIN =
     "Alt-Shift-F9"
 #endif
 };
+#endif // QSCRIPTS_BENCH
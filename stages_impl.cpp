@@ -0,0 +1,130 @@
+//-------------------------------------------------------------------------
+// Stage cache
+//
+// A long analysis script can be split into stages whose results are kept between runs.
+// The script declares each stage with the files it reads (its code and data). A stage is
+// skipped, and its stored result reused, when none of these files changed (by contents)
+// since the stage last completed and no earlier stage had to be executed in this run.
+// Skipped stages rely on their effects still being in the database.
+
+class stage_cache_t
+{
+    struct stage_t
+    {
+        // Hash of the stage's inputs when it last completed
+        uint64 key = 0;
+        bool b_done = false;
+        qstring result;
+
+        // Hash of the stage's inputs in the current run
+        uint64 run_key = 0;
+        bool b_running = false;
+    };
+
+    // Stages by script and name
+    std::unordered_map<std::string, stage_t> m_stages;
+
+    // The current run
+    qstring m_script_file;
+    qstring m_base_dir;
+    bool m_b_dirty = false;
+
+    std::string stage_key(const char *name) const
+    {
+        std::string key(m_script_file.c_str());
+        key += '\n';
+        key += name;
+        return key;
+    }
+
+    // Hashes the stage name and the contents of its inputs (a ';' separated list of paths,
+    // relative to the script's directory). Fails if an input cannot be read.
+    bool hash_inputs(const char *name, const char *inputs, uint64 *hash) const
+    {
+        content_hasher_t hasher;
+        hasher.update(name, strlen(name) + 1);
+
+        for (const char *p = inputs; *p != '\0'; )
+        {
+            const char *end = strchr(p, ';');
+            if (end == nullptr)
+                end = p + strlen(p);
+
+            qstring path(p, end - p);
+            p = *end == '\0' ? end : end + 1;
+
+            path.trim2();
+            if (path.empty())
+                continue;
+
+            make_abs_path(path, m_base_dir.c_str(), true);
+            uint64 file_hash;
+            if (!get_file_content_hash(path.c_str(), &file_hash))
+                return false;
+
+            hasher.update(path.c_str(), path.length() + 1);
+            hasher.update(&file_hash, sizeof(file_hash));
+        }
+        *hash = hasher.digest();
+        return true;
+    }
+
+public:
+    // Starts a new run of a script: its first stage may be skipped again
+    void new_run(const char *script_file)
+    {
+        m_script_file = script_file;
+        m_base_dir = script_file;
+        qdirname(m_base_dir.begin(), m_base_dir.size(), script_file);
+        m_base_dir.resize(strlen(m_base_dir.c_str()));
+        m_b_dirty = false;
+    }
+
+    // Starts a stage. Returns true if the stage can be skipped.
+    bool begin(const char *name, const char *inputs)
+    {
+        auto &stage = m_stages[stage_key(name)];
+        bool b_hashed = hash_inputs(name, inputs, &stage.run_key);
+        if (!m_b_dirty && b_hashed && stage.b_done && stage.key == stage.run_key)
+            return true;
+
+        // The stage runs: so do the next ones, and it stays invalid until it completes
+        m_b_dirty = true;
+        stage.b_done = false;
+        stage.b_running = b_hashed;
+        return false;
+    }
+
+    // The stored result of a skipped stage
+    bool get_result(const char *name, qstring *result) const
+    {
+        auto p = m_stages.find(stage_key(name));
+        if (p == m_stages.end() || !p->second.b_done)
+            return false;
+
+        *result = p->second.result;
+        return true;
+    }
+
+    // Stores the result of a completed stage
+    bool end(const char *name, const char *result)
+    {
+        auto p = m_stages.find(stage_key(name));
+        if (p == m_stages.end() || !p->second.b_running)
+            return false;
+
+        auto &stage = p->second;
+        stage.key       = stage.run_key;
+        stage.result    = result;
+        stage.b_done    = true;
+        stage.b_running = false;
+        return true;
+    }
+
+    // Forgets all the stages (their effects are no longer in the database)
+    void clear()
+    {
+        m_stages.clear();
+        m_b_dirty = false;
+    }
+};
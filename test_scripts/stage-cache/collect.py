@@ -0,0 +1,5 @@
+import idautils
+
+def run():
+    # The expensive part of the pipeline
+    return [ea for ea in idautils.Functions()]
@@ -0,0 +1,21 @@
+import json
+import idc
+
+import collect, report
+
+def _idc_str(s):
+    return '"%s"' % s.replace('\\', '\\\\').replace('"', '\\"')
+
+def stage(name, inputs, func):
+    """Runs a stage unless QScripts has its result from a previous run"""
+    if idc.eval_idc('qscripts_stage_begin(%s, %s)' % (_idc_str(name), _idc_str(';'.join(inputs)))) == 1:
+        print("skipping stage '%s'" % name)
+        return json.loads(idc.eval_idc('qscripts_stage_result(%s)' % _idc_str(name)))
+
+    print("running stage '%s'" % name)
+    result = func()
+    idc.eval_idc('qscripts_stage_end(%s, %s)' % (_idc_str(name), _idc_str(json.dumps(result))))
+    return result
+
+funcs = stage('collect', ['collect.py'], collect.run)
+stage('report', ['report.py'], lambda: report.run(funcs))
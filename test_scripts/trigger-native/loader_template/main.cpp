@@ -92,12 +92,24 @@ bool main()
 {
     msg_clear();
 
-    auto fname = R"(C:\Users\elias\Projects\github\ida-qscripts\samples\chunk1.bin)";
+    // In loader mode, QScripts passes the input file (see the /loader directive)
+    qstring input;
+    if (!qgetenv("QSCRIPTS_LOADER_INPUT", &input))
+        input = R"(C:\Users\elias\Projects\github\ida-qscripts\samples\chunk1.bin)";
+
+    auto fname = input.c_str();
     auto li = open_linput(fname, false);
+    if (li == nullptr)
+        return false;
 
-    if (!test_accept_file(fname))
+    if (!test_accept_file(li, fname))
+    {
+        close_linput(li);
         return false;
-    
+    }
+
+    qlseek(li, 0);
     load_file(li, 0, fname);
     close_linput(li);
+    return true;
 }
\ No newline at end of file
@@ -0,0 +1,5 @@
+# In loader mode, QScripts deletes the segments loaded by the previous run,
+# then loads and runs the new build of the loader (see qscripts_loader.py.deps.qscripts)
+# and then executes this script.
+
+# Optionally, check the loaded database, etc.
\ No newline at end of file
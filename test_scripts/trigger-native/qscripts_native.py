@@ -1,12 +1,8 @@
-import time
-
-# Give the linker time to finish flushing the binary
-time.sleep(1)
+# In native mode, QScripts loads and runs the new build of the plugin
+# (see the /native directive in qscripts_native.py.deps.qscripts)
+# and then executes this script.
 
 # Optionally clear the screen:
 #idaapi.msg_clear()
 
-# Load your plugin and pass any arg value you want
-idaapi.load_and_run_plugin('qscripts_native', 0)
-
 # Optionally, do post work, etc.
\ No newline at end of file
@@ -18,27 +18,535 @@ struct collect_extlangs: extlang_visitor_t
 };
 
 //-------------------------------------------------------------------------
-// Utility function to return a file's last modification timestamp
+// The external languages by script file extension, and the scripts browse filter.
+// Extlangs are installed and removed by plugins: the owner invalidates the cache when
+// a plugin is loaded or unloaded. Unknown extensions are not cached.
+class extlang_cache_t
+{
+    std::unordered_map<std::string, extlang_object_t> m_langs;
+    qstring m_filter;
+
+public:
+    extlang_object_t find(const char *script_file)
+    {
+        auto ext = get_file_ext(script_file);
+        if (ext == nullptr)
+            return extlang_object_t(nullptr);
+
+        auto p = m_langs.find(ext);
+        if (p != m_langs.end())
+            return p->second;
+
+        extlang_object_t elang(find_extlang_by_ext(ext));
+        if (elang != nullptr)
+            m_langs.emplace(ext, elang);
+        return elang;
+    }
+
+    const qstring &browse_filter()
+    {
+        if (!m_filter.empty())
+            return m_filter;
+
+        // Collect all installed external languages
+        extlangs_t langs;
+        collect_extlangs(&langs, false);
+
+        // Build the filter
+        m_filter = "FILTER Script files|";
+
+        for (auto lang: langs)
+            m_filter.cat_sprnt("*.%s;", lang->fileext);
+
+        m_filter.remove_last();
+        m_filter.append("|");
+
+        // Language specific filters
+        for (auto lang: langs)
+            m_filter.cat_sprnt("%s scripts|*.%s|", lang->name, lang->fileext);
+
+        m_filter.remove_last();
+        m_filter.append("\nSelect script file to load");
+        return m_filter;
+    }
+
+    void invalidate()
+    {
+        m_langs.clear();
+        m_filter.qclear();
+    }
+};
+
+//-------------------------------------------------------------------------
+// File modification time stamp in nanoseconds.
+// Only meant to be compared against other values returned by get_file_modification_time().
+using file_time_t = uint64;
+
+#if defined(__NT__)
+inline file_time_t filetime_to_file_time(const FILETIME &ft)
+{
+    // FILETIME counts 100ns intervals
+    return ((uint64(ft.dwHighDateTime) << 32) | ft.dwLowDateTime) * 100;
+}
+#else
+inline void get_stat_time_and_size(const struct stat &st, file_time_t *mtime, uint64 *size)
+{
+    if (mtime != nullptr)
+    {
+#   if defined(__MAC__)
+        const struct timespec &ts = st.st_mtimespec;
+#   else
+        const struct timespec &ts = st.st_mtim;
+#   endif
+        *mtime = uint64(ts.tv_sec) * 1000000000ULL + uint64(ts.tv_nsec);
+    }
+    if (size != nullptr)
+        *size = uint64(st.st_size);
+}
+#endif
+
+// Utility function to return a file's last modification timestamp (and optionally its size).
+// The native stat functions are used because qstat() only has a one second resolution.
 bool get_file_modification_time(
     const char *filename,
-    qtime64_t *mtime = nullptr)
+    file_time_t *mtime = nullptr,
+    uint64 *size = nullptr)
 {
-    qstatbuf stat_buf;
-    if (qstat(filename, &stat_buf) != 0)
+#if defined(__NT__)
+    qwstring wpath;
+    WIN32_FILE_ATTRIBUTE_DATA attrs;
+    if (    !utf8_utf16(&wpath, filename)
+         || !GetFileAttributesExW(wpath.c_str(), GetFileExInfoStandard, &attrs))
+    {
         return false;
+    }
 
     if (mtime != nullptr)
-        *mtime = stat_buf.qst_mtime;
+        *mtime = filetime_to_file_time(attrs.ftLastWriteTime);
+    if (size != nullptr)
+        *size = (uint64(attrs.nFileSizeHigh) << 32) | attrs.nFileSizeLow;
+#else
+    struct stat st;
+    if (stat(filename, &st) != 0)
+        return false;
+
+    get_stat_time_and_size(st, mtime, size);
+#endif
     return true;
 }
 
 bool get_file_modification_time(
     const qstring &filename,
-    qtime64_t *mtime = nullptr)
+    file_time_t *mtime = nullptr,
+    uint64 *size = nullptr)
+{
+    return get_file_modification_time(filename.c_str(), mtime, size);
+}
+
+//-------------------------------------------------------------------------
+// Checks that no other process still has a file opened for writing.
+// On MS Windows, a file opened for writing cannot be opened without sharing the writes.
+// Elsewhere there is no such probe: only the time stamp and size stability applies.
+bool is_file_write_complete(const char *filename)
 {
-    return get_file_modification_time(filename.c_str(), mtime);
+#if defined(__NT__)
+    qwstring wpath;
+    if (!utf8_utf16(&wpath, filename))
+        return true;
+
+    HANDLE hfile = CreateFileW(
+        wpath.c_str(),
+        GENERIC_READ,
+        FILE_SHARE_READ,
+        nullptr,
+        OPEN_EXISTING,
+        FILE_ATTRIBUTE_NORMAL,
+        nullptr);
+    if (hfile == INVALID_HANDLE_VALUE)
+        return GetLastError() != ERROR_SHARING_VIOLATION;
+    CloseHandle(hfile);
+    return true;
+#else
+    (void)filename;
+    return true;
+#endif
 }
 
+//-------------------------------------------------------------------------
+// Fast non-cryptographic 64-bit hash (8 bytes per round, FNV-1a for the tail)
+struct content_hasher_t
+{
+    static constexpr uint64 SEED  = 0xcbf29ce484222325ULL;
+    static constexpr uint64 PRIME = 0x100000001b3ULL;
+    static constexpr uint64 MIX   = 0x9e3779b97f4a7c15ULL;
+
+    uint64 h = SEED;
+
+    void update(const void *data, size_t size)
+    {
+        auto p = (const uchar *)data;
+        for (; size >= 8; p += 8, size -= 8)
+        {
+            uint64 w;
+            memcpy(&w, p, sizeof(w));
+            w *= MIX;
+            w ^= w >> 32;
+            h = (h ^ w) * PRIME;
+            h ^= h >> 29;
+        }
+        for (; size != 0; ++p, --size)
+            h = (h ^ *p) * PRIME;
+    }
+
+    uint64 digest() const
+    {
+        uint64 d = h;
+        d ^= d >> 33;
+        d *= 0xff51afd7ed558ccdULL;
+        d ^= d >> 33;
+        return d;
+    }
+};
+
+// Files larger than this are memory mapped instead of read in chunks
+static constexpr uint64 HASH_MMAP_THRESHOLD = 1024 * 1024;
+
+// Hashes a file through a memory mapping. The mapping covers the size of the opened file:
+// if it differs from 'size' (the size seen when the file was stat'ed), the file is being
+// rewritten and is not mapped. On failure, nothing is hashed and the file should be read instead.
+#if defined(__NT__)
+static bool hash_mapped_file(const char *filename, uint64 size, content_hasher_t &hasher)
+{
+    qwstring wpath;
+    if (!utf8_utf16(&wpath, filename))
+        return false;
+
+    // No write sharing: a file still opened for writing is read instead, and the
+    // mapping does not keep a writer from truncating the file
+    HANDLE hfile = CreateFileW(
+        wpath.c_str(),
+        GENERIC_READ,
+        FILE_SHARE_READ | FILE_SHARE_DELETE,
+        nullptr,
+        OPEN_EXISTING,
+        FILE_ATTRIBUTE_NORMAL | FILE_FLAG_SEQUENTIAL_SCAN,
+        nullptr);
+    if (hfile == INVALID_HANDLE_VALUE)
+        return false;
+
+    bool ok = false;
+    LARGE_INTEGER cur_size;
+    if (     GetFileSizeEx(hfile, &cur_size)
+         &&  cur_size.QuadPart != 0
+         &&  uint64(cur_size.QuadPart) == size
+         &&  uint64(cur_size.QuadPart) <= SIZE_MAX)
+    {
+        HANDLE hmap = CreateFileMappingW(hfile, nullptr, PAGE_READONLY, cur_size.HighPart, cur_size.LowPart, nullptr);
+        if (hmap != nullptr)
+        {
+            if (auto view = MapViewOfFile(hmap, FILE_MAP_READ, 0, 0, size_t(cur_size.QuadPart)))
+            {
+                hasher.update(view, size_t(cur_size.QuadPart));
+                UnmapViewOfFile(view);
+                ok = true;
+            }
+            CloseHandle(hmap);
+        }
+    }
+    CloseHandle(hfile);
+    return ok;
+}
+#else
+static bool hash_mapped_file(const char *filename, uint64 size, content_hasher_t &hasher)
+{
+    int fd = open(filename, O_RDONLY | O_CLOEXEC);
+    if (fd == -1)
+        return false;
+
+    bool ok = false;
+    struct stat st;
+    if (     fstat(fd, &st) == 0
+         &&  st.st_size > 0
+         &&  uint64(st.st_size) == size
+         &&  uint64(st.st_size) <= SIZE_MAX)
+    {
+        size_t len = size_t(st.st_size);
+        void *view = mmap(nullptr, len, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (view != MAP_FAILED)
+        {
+            hasher.update(view, len);
+            munmap(view, len);
+            ok = true;
+        }
+    }
+    close(fd);
+    return ok;
+}
+#endif
+
+// Computes the content hash of a file
+bool get_file_content_hash(const char *filename, uint64 *hash)
+{
+    uint64 size;
+    if (!get_file_modification_time(filename, nullptr, &size))
+        return false;
+
+    content_hasher_t hasher;
+    if (size < HASH_MMAP_THRESHOLD || !hash_mapped_file(filename, size, hasher))
+    {
+        FILE *fp = qfopen(filename, "rb");
+        if (fp == nullptr)
+            return false;
+
+        uchar buf[16 * 1024];
+        for (ssize_t n; (n = qfread(fp, buf, sizeof(buf))) > 0;)
+            hasher.update(buf, size_t(n));
+        qfclose(fp);
+    }
+
+    *hash = hasher.digest();
+    return true;
+}
+
+//-------------------------------------------------------------------------
+// Checks if this process owns the foreground window (always true where unknown)
+bool is_foreground_process()
+{
+#if defined(__NT__)
+    DWORD pid = 0;
+    HWND hwnd = GetForegroundWindow();
+    if (hwnd == nullptr)
+        return true;
+    GetWindowThreadProcessId(hwnd, &pid);
+    return pid == GetCurrentProcessId();
+#else
+    return true;
+#endif
+}
+
+//-------------------------------------------------------------------------
+// Returns the lookup key of a path (case insensitive on MS Windows)
+inline std::string filemon_key(const char *path)
+{
+    std::string key = path;
+#ifdef __NT__
+    for (auto &ch: key)
+    {
+        if (ch == '/')
+            ch = '\\';
+        else if (ch >= 'A' && ch <= 'Z')
+            ch += 'a' - 'A';
+    }
+#endif
+    return key;
+}
+
+//-------------------------------------------------------------------------
+// Files metadata gathered during a monitor scan.
+// Files shared by several active scripts are only stat'ed (and hashed) once per scan.
+struct file_stat_t
+{
+    // The scan this record was last filled in
+    uint32 scan = 0;
+
+    bool exists = false;
+    file_time_t mtime = 0;
+    uint64 size = 0;
+
+    // The content hash is computed on demand
+    bool b_hash_done = false;
+    bool b_hash = false;
+    uint64 hash = 0;
+};
+
+// The metadata records are kept in a flat array indexed by path id. Path ids are
+// assigned once per path and callers can keep them as lookup hints, so the steady
+// state scan neither allocates nor walks a hash table.
+class file_stat_cache_t
+{
+    static constexpr uint32 NO_ID = UINT32_MAX;
+
+    qvector<file_stat_t> m_records;
+    qstrvec_t m_paths;
+    std::unordered_map<std::string, uint32> m_ids;
+    uint32 m_scan = 1;
+
+    file_stat_t &stat_file(uint32 id)
+    {
+        auto &st = m_records[id];
+        st.scan = m_scan;
+        st.b_hash_done = false;
+        st.exists = get_file_modification_time(m_paths[id], &st.mtime, &st.size);
+        return st;
+    }
+
+    void set_missing(uint32 id)
+    {
+        auto &st = m_records[id];
+        st.scan = m_scan;
+        st.exists = st.b_hash_done = false;
+    }
+
+public:
+    // Returns the id of a path, assigning one if needed
+    uint32 add(const char *path)
+    {
+        auto ins = m_ids.emplace(path, uint32(m_paths.size()));
+        if (ins.second)
+        {
+            m_paths.push_back(path);
+            m_records.push_back();
+        }
+        return ins.first->second;
+    }
+
+    // Returns the id of a path. 'hint' is the id returned by a previous lookup of the
+    // same path (if any); it is checked, then updated.
+    uint32 find(const qstring &path, uint32 *hint = nullptr)
+    {
+        if (hint != nullptr && *hint < m_paths.size() && m_paths[*hint] == path)
+            return *hint;
+
+        uint32 id = add(path.c_str());
+        if (hint != nullptr)
+            *hint = id;
+        return id;
+    }
+
+    // Returns the metadata of a file, stat'ing it on demand if it was not part of the current scan
+    file_stat_t &get(const qstring &path, uint32 *hint = nullptr)
+    {
+        uint32 id = find(path, hint);
+        auto &st = m_records[id];
+        return st.scan == m_scan ? st : stat_file(id);
+    }
+
+    // Returns the metadata of a file if it was already read during the current scan
+    const file_stat_t *peek(const qstring &path, uint32 *hint = nullptr)
+    {
+        auto &st = m_records[find(path, hint)];
+        return st.scan == m_scan ? &st : nullptr;
+    }
+
+    bool get_hash(const qstring &path, uint64 *hash, uint32 *hint = nullptr)
+    {
+        uint32 id = find(path, hint);
+        auto &st = get(path, &id);
+        if (!st.b_hash_done)
+        {
+            st.b_hash_done = true;
+            st.b_hash = st.exists && get_file_content_hash(m_paths[id].c_str(), &st.hash);
+        }
+        *hash = st.hash;
+        return st.b_hash;
+    }
+
+    // Starts a new scan: all the records become stale
+    void new_scan()
+    {
+        if (++m_scan == 0)
+        {
+            for (auto &st: m_records)
+                st.scan = 0;
+            m_scan = 1;
+        }
+    }
+
+    // Reads the metadata of files in the same directory. Only MS Windows gets them in one
+    // batch (a single directory listing). The other platforms still stat each file, relative
+    // to the opened directory so that the directory path is only resolved once: the directory
+    // time stamps cannot tell which files were modified in place.
+    void stat_dir(const char *dir, const qvector<uint32> &ids)
+    {
+#if defined(__NT__)
+        // Listing the directory is only worth it for several files
+        if (ids.size() < 2)
+        {
+            for (auto id: ids)
+                stat_file(id);
+            return;
+        }
+
+        // All the files missing from the listing no longer exist. The metadata of the previous
+        // scan is kept to spot the files that changed.
+        std::unordered_map<std::string, std::pair<uint32, bool>> names;
+        for (auto id: ids)
+        {
+            names.emplace(filemon_key(qbasename(m_paths[id].c_str())), std::make_pair(id, m_records[id].exists));
+            set_missing(id);
+        }
+
+        qwstring wpattern;
+        qstring pattern(dir);
+        pattern.append("\\*");
+        if (!utf8_utf16(&wpattern, pattern.c_str()))
+            return;
+
+        WIN32_FIND_DATAW fd;
+        HANDLE hfind = FindFirstFileExW(
+            wpattern.c_str(),
+            FindExInfoBasic,
+            &fd,
+            FindExSearchNameMatch,
+            nullptr,
+            FIND_FIRST_EX_LARGE_FETCH);
+        if (hfind == INVALID_HANDLE_VALUE)
+            return;
+
+        qstring name;
+        do
+        {
+            if ((fd.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) != 0 || !utf16_utf8(&name, fd.cFileName))
+                continue;
+
+            auto p = names.find(filemon_key(name.c_str()));
+            if (p == names.end())
+                continue;
+
+            // The directory entries are not always current (files still opened for writing):
+            // the files that look changed are read again like get_file_modification_time() does
+            uint32 id  = p->second.first;
+            auto &st   = m_records[id];
+            auto mtime = filetime_to_file_time(fd.ftLastWriteTime);
+            auto size  = (uint64(fd.nFileSizeHigh) << 32) | fd.nFileSizeLow;
+            if (p->second.second && st.mtime == mtime && st.size == size)
+                st.exists = true;
+            else
+                stat_file(id);
+        } while (FindNextFileW(hfind, &fd));
+        FindClose(hfind);
+#else
+        int dfd = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (dfd == -1)
+        {
+            for (auto id: ids)
+                set_missing(id);
+            return;
+        }
+
+        for (auto id: ids)
+        {
+            auto &st = m_records[id];
+            struct stat s;
+            st.scan = m_scan;
+            st.b_hash_done = false;
+            st.exists = fstatat(dfd, qbasename(m_paths[id].c_str()), &s, 0) == 0;
+            if (st.exists)
+                get_stat_time_and_size(s, &st.mtime, &st.size);
+        }
+        close(dfd);
+#endif
+    }
+
+    void clear()
+    {
+        m_records.qclear();
+        m_paths.qclear();
+        m_ids.clear();
+        new_scan();
+    }
+};
+
 //-------------------------------------------------------------------------
 void normalize_path_sep(qstring &path)
 {
@@ -50,23 +558,36 @@ void normalize_path_sep(qstring &path)
 }
 
 //-------------------------------------------------------------------------
+// Returns the absolute and normalized form of a base directory.
+// Results are cached per directory; the process working directory is never changed.
+const std::filesystem::path &get_abs_base_dir(const char *base_dir)
+{
+    static std::mutex mutex;
+    static std::unordered_map<std::string, std::filesystem::path> cache;
+
+    std::lock_guard<std::mutex> lock(mutex);
+    auto p = cache.find(base_dir);
+    if (p != cache.end())
+        return p->second;
+
+    auto base = std::filesystem::u8path(base_dir);
+    if (!base.is_absolute())
+        base = std::filesystem::absolute(base);
+
+    return cache[base_dir] = base.lexically_normal();
+}
+
+//-------------------------------------------------------------------------
+// Resolves a relative path against 'base_dir' (or the current directory) by
+// joining and normalizing the paths. Safe to call from any thread.
 void make_abs_path(qstring& path, const char* base_dir = nullptr, bool normalize = false)
 {
     if (qisabspath(path.c_str()))
         return;
 
-    auto old_cwd = std::filesystem::current_path();
-    if (base_dir == nullptr)
-    {
-        path = old_cwd.string().c_str();
-    }
-    else
-    {
-        std::filesystem::current_path(base_dir);
-        auto abs = std::filesystem::absolute(path.c_str());
-        path = abs.string().c_str();
-        std::filesystem::current_path(old_cwd);
-    }
+    auto rel = std::filesystem::u8path(path.c_str());
+    auto abs = base_dir == nullptr ? std::filesystem::absolute(rel) : get_abs_base_dir(base_dir) / rel;
+    path = abs.lexically_normal().u8string().c_str();
     if (normalize)
         normalize_path_sep(path);
 }
@@ -93,50 +614,195 @@ inline void get_current_directory(qstring &dir)
 }
 
 //-------------------------------------------------------------------------
-// Utility function similar to Python's re.sub().
-// Based on https://stackoverflow.com/a/37516316
-namespace std
+// Minimal binary serialization to a buffer (native byte order, for local caches only)
+struct bin_writer_t
 {
-    template<class BidirIt, class Traits, class CharT, class UnaryFunction>
-    std::basic_string<CharT> regex_replace(BidirIt first, BidirIt last,
-        const std::basic_regex<CharT, Traits> &re, UnaryFunction f)
+    qvector<uchar> buf;
+
+    void put(const void *data, size_t size)
     {
-        std::basic_string<CharT> s;
+        auto p = (const uchar *)data;
+        buf.insert(buf.end(), p, p + size);
+    }
 
-        typename std::match_results<BidirIt>::difference_type positionOfLastMatch = 0;
-        auto endOfLastMatch = first;
+    void u8(uchar v)   { put(&v, sizeof(v)); }
+    void u32(uint32 v) { put(&v, sizeof(v)); }
+    void u64(uint64 v) { put(&v, sizeof(v)); }
 
-        auto callback = [&](const std::match_results<BidirIt> &match)
-        {
-            auto positionOfThisMatch = match.position(0);
-            auto diff = positionOfThisMatch - positionOfLastMatch;
+    void str(const qstring &s)
+    {
+        u32(uint32(s.length()));
+        put(s.c_str(), s.length());
+    }
+
+    // Writes the buffer followed by its checksum
+    bool save(const char *file_path) const
+    {
+        content_hasher_t hasher;
+        hasher.update(buf.begin(), buf.size());
+        uint64 checksum = hasher.digest();
+
+        FILE *fp = qfopen(file_path, "wb");
+        if (fp == nullptr)
+            return false;
 
-            auto startOfThisMatch = endOfLastMatch;
-            std::advance(startOfThisMatch, diff);
+        bool ok =     qfwrite(fp, buf.begin(), buf.size()) == ssize_t(buf.size())
+                  &&  qfwrite(fp, &checksum, sizeof(checksum)) == ssize_t(sizeof(checksum));
+        qfclose(fp);
+        return ok;
+    }
+};
 
-            s.append(endOfLastMatch, startOfThisMatch);
-            s.append(f(match));
+struct bin_reader_t
+{
+    qvector<uchar> buf;
+    size_t pos = 0;
+    bool ok = true;
 
-            auto lengthOfMatch = match.length(0);
+    bool load(const char *file_path)
+    {
+        uint64 size;
+        if (!get_file_modification_time(file_path, nullptr, &size))
+            return false;
 
-            positionOfLastMatch = positionOfThisMatch + lengthOfMatch;
+        FILE *fp = qfopen(file_path, "rb");
+        if (fp == nullptr)
+            return false;
 
-            endOfLastMatch = startOfThisMatch;
-            std::advance(endOfLastMatch, lengthOfMatch);
-        };
+        buf.resize(size_t(size));
+        ok = qfread(fp, buf.begin(), buf.size()) == ssize_t(buf.size());
+        qfclose(fp);
+        pos = 0;
 
-        std::regex_iterator<BidirIt> begin(first, last, re), end;
-        std::for_each(begin, end, callback);
+        // Verify and drop the trailing checksum
+        uint64 checksum;
+        if (!ok || buf.size() < sizeof(checksum))
+            return ok = false;
+        memcpy(&checksum, buf.end() - sizeof(checksum), sizeof(checksum));
+        buf.resize(buf.size() - sizeof(checksum));
 
-        s.append(endOfLastMatch, last);
+        content_hasher_t hasher;
+        hasher.update(buf.begin(), buf.size());
+        return ok = hasher.digest() == checksum;
+    }
 
-        return s;
+    bool get(void *data, size_t size)
+    {
+        if (!ok || buf.size() - pos < size)
+            return ok = false;
+        memcpy(data, buf.begin() + pos, size);
+        pos += size;
+        return true;
     }
 
-    template<class Traits, class CharT, class UnaryFunction>
-    std::string regex_replace(const std::string &s,
-        const std::basic_regex<CharT, Traits> &re, UnaryFunction f)
+    uchar  u8()  { uchar v = 0;  get(&v, sizeof(v)); return v; }
+    uint32 u32() { uint32 v = 0; get(&v, sizeof(v)); return v; }
+    uint64 u64() { uint64 v = 0; get(&v, sizeof(v)); return v; }
+
+    bool str(qstring &s)
     {
-        return regex_replace(s.cbegin(), s.cend(), re, f);
+        uint32 len = u32();
+        if (!ok || buf.size() - pos < len)
+            return ok = false;
+        s.qclear();
+        s.append((const char *)buf.begin() + pos, len);
+        pos += len;
+        return true;
     }
-}
+};
+
+//-------------------------------------------------------------------------
+// Expandable string template: a string with '$variable$' references that is
+// tokenized once into literal and variable segments
+enum class expand_seg_e
+{
+    literal,
+    basename,
+    pkgbase,
+    pkgmodname,
+    env,
+    unknown
+};
+
+struct expand_template_t
+{
+    struct segment_t
+    {
+        expand_seg_e kind;
+
+        // The literal text, the environment variable name or the unknown variable name
+        qstring text;
+    };
+    qvector<segment_t> segments;
+
+    // Total length of the literal segments and the count of variable segments
+    size_t literal_size = 0;
+    size_t nvars        = 0;
+
+    expand_template_t(const char *str = nullptr)
+    {
+        if (str != nullptr)
+            compile(str);
+    }
+
+    void compile(const char *str)
+    {
+        segments.qclear();
+        literal_size = nvars = 0;
+
+        // A variable is a '$' followed by at least one character up to the next '$'
+        const char *lit = str;
+        for (const char *p = str; (p = strchr(p, '$')) != nullptr; )
+        {
+            const char *end = p[1] == '\0' ? nullptr : strchr(p + 2, '$');
+            if (end == nullptr)
+                break;
+
+            add_literal(lit, p - lit);
+            add_var(p + 1, end - p - 1);
+            lit = p = end + 1;
+        }
+        add_literal(lit, strlen(lit));
+    }
+
+private:
+    void add_literal(const char *str, size_t len)
+    {
+        if (len == 0)
+            return;
+
+        auto &seg = segments.push_back();
+        seg.kind  = expand_seg_e::literal;
+        seg.text  = qstring(str, len);
+        literal_size += len;
+    }
+
+    void add_var(const char *name, size_t len)
+    {
+        static const struct
+        {
+            const char *prefix;
+            size_t len;
+            expand_seg_e kind;
+        } vars[] =
+        {
+            { "pkgmodname", 10, expand_seg_e::pkgmodname },
+            { "pkgbase",     7, expand_seg_e::pkgbase },
+            { "basename",    8, expand_seg_e::basename },
+            { "env:",        4, expand_seg_e::env },
+        };
+
+        auto &seg = segments.push_back();
+        seg.kind  = expand_seg_e::unknown;
+        seg.text  = qstring(name, len);
+        for (auto &var: vars)
+        {
+            if (len >= var.len && strncmp(name, var.prefix, var.len) == 0)
+            {
+                seg.kind = var.kind;
+                break;
+            }
+        }
+        ++nvars;
+    }
+};
@@ -0,0 +1,502 @@
+//-------------------------------------------------------------------------
+// Shared watcher
+//
+// Several IDA instances working on the same scripts tree would each watch (or poll) the
+// same files. With the shared watcher, a single hub watches the files of all the instances
+// and broadcasts their changes: the hub listens on a well known endpoint of the channel
+// (see ipc_impl.cpp) and the first instance that finds no hub there becomes the hub. When
+// the hub instance exits, the next one to notice takes over.
+//
+// The protocol is line based and can be served by a standalone helper as well:
+//
+//      watch <file>        (from the subscriber) watch a file, no reply
+//      unwatch <file>      (from the subscriber) stop watching a file, no reply
+//      unwatch             (from the subscriber) stop watching all of its files, no reply
+//      changed <file>      (from the hub) a watched file may have changed
+//      rescan              (from the hub) events were lost: all the files may have changed
+
+class watch_hub_t
+{
+    struct watched_file_t
+    {
+        qstring path;
+        int refs = 0;
+
+        // Last seen metadata (polling only)
+        bool exists = false;
+        file_time_t mtime = 0;
+        uint64 size = 0;
+    };
+
+    ipc_server_t m_server;
+    std::thread m_thread;
+    std::atomic<bool> m_b_stop{false};
+    int m_event_interval = 10;
+    int m_poll_interval  = 1000;
+
+    // The watched files by key and the keys watched by each subscriber (guarded by m_mutex)
+    std::mutex m_mutex;
+    std::condition_variable m_cv;
+    std::map<std::string, watched_file_t> m_files;
+    std::unordered_map<uint32, std::unordered_set<std::string>> m_client_files;
+    bool m_b_rewatch = true;
+
+    // Used by the hub thread only
+    std::unique_ptr<filemon_backend_t> m_backend;
+#if !defined(__NT__)
+    filemon_waiter_t m_waiter;
+#endif
+
+    void wake()
+    {
+        m_cv.notify_one();
+#if !defined(__NT__)
+        m_waiter.wake();
+#endif
+    }
+
+    static void stat_file(watched_file_t &file)
+    {
+        file.exists = get_file_modification_time(file.path, &file.mtime, &file.size);
+    }
+
+    void release_client(uint32 client)
+    {
+        auto p = m_client_files.find(client);
+        if (p == m_client_files.end())
+            return;
+
+        for (auto &key: p->second)
+        {
+            auto pf = m_files.find(key);
+            if (pf != m_files.end() && --pf->second.refs == 0)
+                m_files.erase(pf);
+        }
+        m_client_files.erase(p);
+        m_b_rewatch = true;
+    }
+
+    // Handles a subscriber's command (on the channel's threads)
+    void handle_command(uint32 client, const qstring &command, qstring &reply)
+    {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        bool b_was_rewatch = m_b_rewatch;
+        if (strncmp(command.c_str(), "watch ", 6) == 0)
+        {
+            qstring path = command.c_str() + 6;
+            path.trim2();
+            auto key = filemon_key(path.c_str());
+            if (!m_client_files[client].insert(key).second)
+                return;
+
+            auto &file = m_files[key];
+            if (file.refs++ == 0)
+            {
+                file.path = path;
+                stat_file(file);
+                m_b_rewatch = true;
+            }
+        }
+        else if (strncmp(command.c_str(), "unwatch ", 8) == 0)
+        {
+            qstring path = command.c_str() + 8;
+            path.trim2();
+            auto key = filemon_key(path.c_str());
+            auto p = m_client_files.find(client);
+            if (p == m_client_files.end() || p->second.erase(key) == 0)
+                return;
+
+            auto pf = m_files.find(key);
+            if (pf != m_files.end() && --pf->second.refs == 0)
+            {
+                m_files.erase(pf);
+                m_b_rewatch = true;
+            }
+        }
+        else if (command == "unwatch")
+        {
+            release_client(client);
+        }
+        else
+        {
+            reply.sprnt("error unknown command '%s'", command.c_str());
+        }
+
+        // The hub thread may be blocked on the events of the previous watch set
+        if (m_b_rewatch && !b_was_rewatch)
+        {
+            lock.unlock();
+            wake();
+        }
+    }
+
+    // Registers the watched directories with the backend (under the lock)
+    void rewatch()
+    {
+        std::map<std::string, std::pair<qstring, qstrvec_t>> dirs;
+        qstring dir;
+        for (auto &kv: m_files)
+        {
+            auto &path = kv.second.path;
+            dir.resize(path.size());
+            qdirname(dir.begin(), dir.size(), path.c_str());
+            dir.resize(strlen(dir.c_str()));
+
+            auto &wd = dirs[filemon_key(dir.c_str())];
+            if (wd.first.empty())
+                wd.first = dir;
+            wd.second.push_back(path);
+        }
+
+        m_backend->clear();
+        for (auto &kv: dirs)
+        {
+            if (!m_backend->add_dir(kv.second.first.c_str(), kv.second.second) && !m_backend->is_polling())
+            {
+                msg("QScripts: the shared watcher cannot watch '%s' with %s, falling back to polling\n",
+                    kv.second.first.c_str(),
+                    m_backend->name());
+                m_backend.reset(new filemon_poll_backend_t());
+                break;
+            }
+        }
+        m_b_rewatch = false;
+    }
+
+    // Polling: stats all the watched files, outside of the lock
+    void poll_files(filemon_changes_t &changes)
+    {
+        std::vector<std::pair<std::string, watched_file_t>> files;
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            files.reserve(m_files.size());
+            for (auto &kv: m_files)
+                files.emplace_back(kv.first, kv.second);
+        }
+
+        for (auto &kv: files)
+        {
+            watched_file_t now = kv.second;
+            stat_file(now);
+            if (     now.exists != kv.second.exists
+                 ||  now.mtime  != kv.second.mtime
+                 ||  now.size   != kv.second.size)
+            {
+                kv.second = now;
+                changes.insert(kv.first);
+            }
+        }
+
+        std::lock_guard<std::mutex> lock(m_mutex);
+        for (auto &key: changes)
+        {
+            auto p = m_files.find(key);
+            if (p == m_files.end())
+                continue;
+            for (auto &kv: files)
+            {
+                if (kv.first == key)
+                {
+                    p->second.exists = kv.second.exists;
+                    p->second.mtime  = kv.second.mtime;
+                    p->second.size   = kv.second.size;
+                    break;
+                }
+            }
+        }
+    }
+
+    void thread_proc()
+    {
+        while (!m_b_stop)
+        {
+            {
+                std::lock_guard<std::mutex> lock(m_mutex);
+                if (m_b_rewatch)
+                    rewatch();
+            }
+
+            filemon_changes_t changes;
+            if (m_backend->is_polling())
+            {
+                poll_files(changes);
+            }
+            else if (!m_backend->drain(changes))
+            {
+                // Events were lost: the subscribers check all their files
+                std::lock_guard<std::mutex> lock(m_mutex);
+                rewatch();
+                m_server.send_all("rescan");
+            }
+
+            qstring line;
+            for (auto &key: changes)
+            {
+                line.sprnt("changed %s", key.c_str());
+                m_server.send_all(line);
+            }
+
+#if !defined(__NT__)
+            // Block on the backend's events (woken up by a new watch set and on stop)
+            int event_fd = m_backend->event_fd();
+            if (event_fd != -1 && m_waiter.ok())
+            {
+                {
+                    std::lock_guard<std::mutex> lock(m_mutex);
+                    if (m_b_stop || m_b_rewatch)
+                        continue;
+                }
+                m_waiter.wait(event_fd, m_backend->has_lost_dirs() ? FILEMON_LOST_DIR_INTERVAL : -1);
+                continue;
+            }
+#endif
+            std::unique_lock<std::mutex> lock(m_mutex);
+            m_cv.wait_for(
+                lock,
+                std::chrono::milliseconds(m_backend->is_polling() ? m_poll_interval : m_event_interval),
+                [this] { return m_b_stop || m_b_rewatch; });
+        }
+    }
+
+public:
+    // The endpoint of the hub: one per user
+    static void get_default_endpoint(qstring &endpoint)
+    {
+#if defined(__NT__)
+        qstring user;
+        if (!qgetenv("USERNAME", &user))
+            user = "default";
+        endpoint.sprnt("\\\\.\\pipe\\qscripts.watch.%s", user.c_str());
+#else
+        endpoint.sprnt("%s" SDIRCHAR "qscripts.watch.sock", get_user_idadir());
+#endif
+    }
+
+    // Starts serving the endpoint. Fails if another hub already serves it.
+    bool start(const char *endpoint, int event_interval, int poll_interval, qstring &err)
+    {
+        m_event_interval = event_interval;
+        m_poll_interval  = poll_interval;
+        m_backend.reset(create_filemon_backend());
+        m_b_rewatch = true;
+        m_b_stop = false;
+
+        auto handler = [this](uint32 client, const qstring &command, qstring &reply)
+        {
+            handle_command(client, command, reply);
+        };
+        auto closed_handler = [this](uint32 client)
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            release_client(client);
+        };
+        // The socket is only removed once it is known to be stale: the hubs
+        // started at the same time would otherwise replace each other's.
+        if (!m_server.start(endpoint, handler, err, closed_handler, true))
+            return false;
+
+        try
+        {
+            m_thread = std::thread(&watch_hub_t::thread_proc, this);
+        }
+        catch (const std::system_error &)
+        {
+            err = "cannot start the shared watcher thread";
+            m_server.stop();
+            return false;
+        }
+        return true;
+    }
+
+    void stop()
+    {
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_b_stop = true;
+        }
+        wake();
+        if (m_thread.joinable())
+            m_thread.join();
+        m_server.stop();
+
+        m_files.clear();
+        m_client_files.clear();
+        m_backend.reset();
+    }
+
+    ~watch_hub_t()
+    {
+        stop();
+    }
+};
+
+//-------------------------------------------------------------------------
+// File monitor backend subscribing to the shared watcher.
+// If there is no hub yet, this instance becomes the hub. While neither is possible,
+// the files are polled and connecting to the hub is retried from time to time.
+struct filemon_shared_backend_t: filemon_backend_t
+{
+    static constexpr int RETRY_INTERVAL_MS = 5000;
+
+    qstring endpoint;
+    int event_interval;
+    int poll_interval;
+    ipc_client_t client;
+    std::unique_ptr<watch_hub_t> hub;
+
+    // The files to watch and the files the hub watches for this instance, by key.
+    // Only the differences are sent to the hub, and all the files after reconnecting.
+    std::map<std::string, qstring> files;
+    std::map<std::string, qstring> subscribed;
+    bool b_dirty = false;
+    std::chrono::steady_clock::time_point last_attempt;
+    bool b_failed = false;
+
+    filemon_shared_backend_t(const char *endpoint, int event_interval, int poll_interval)
+        : endpoint(endpoint), event_interval(event_interval), poll_interval(poll_interval)
+    {
+    }
+
+    const char *name() const override { return hub ? "shared watcher (hub)" : "shared watcher"; }
+
+    // Polling until connected to the hub
+    bool is_polling() const override { return !client.is_connected(); }
+
+#if !defined(__NT__)
+    int event_fd() const override { return client.is_connected() ? client.get_fd() : -1; }
+#endif
+
+    // While polling, connecting is only attempted every RETRY_INTERVAL_MS
+    bool is_retry_due() const
+    {
+        return std::chrono::duration_cast<std::chrono::milliseconds>(
+            std::chrono::steady_clock::now() - last_attempt).count() >= RETRY_INTERVAL_MS;
+    }
+
+    // Connects to the hub, becoming the hub if there is none
+    bool connect()
+    {
+        if (client.is_connected())
+            return true;
+
+        last_attempt = std::chrono::steady_clock::now();
+        qstring err;
+        bool b_no_server;
+        for (int attempt = 0; attempt < 2; ++attempt)
+        {
+            if (client.connect(endpoint.c_str(), &b_no_server, err))
+            {
+                if (b_failed)
+                    msg("QScripts: using the shared watcher on '%s' again\n", endpoint.c_str());
+                b_failed = false;
+                return true;
+            }
+            if (!b_no_server || hub)
+                break;
+
+#if !defined(__NT__)
+            // Left behind by a hub that did not exit cleanly: only removed if nothing listens on it
+            ipc_server_t::remove_stale_socket(endpoint.c_str());
+#endif
+            // Another instance may become the hub first: connect to it then
+            auto new_hub = std::make_unique<watch_hub_t>();
+            if (new_hub->start(endpoint.c_str(), event_interval, poll_interval, err))
+            {
+                msg("QScripts: the shared watcher serves the other instances on '%s'\n", endpoint.c_str());
+                hub = std::move(new_hub);
+            }
+        }
+        if (!b_failed)
+            msg("QScripts: cannot use the shared watcher, polling meanwhile: %s\n", err.c_str());
+        b_failed = true;
+        return false;
+    }
+
+    // Tells the hub about the files added to or removed from the watch set
+    void sync()
+    {
+        if (!b_dirty || !client.is_connected())
+            return;
+
+        qstring line;
+        for (auto p = subscribed.begin(); p != subscribed.end(); )
+        {
+            if (files.find(p->first) != files.end())
+            {
+                ++p;
+                continue;
+            }
+            line.sprnt("unwatch %s", p->second.c_str());
+            if (!client.send_line(line))
+                return;
+            p = subscribed.erase(p);
+        }
+        for (auto &kv: files)
+        {
+            if (subscribed.find(kv.first) != subscribed.end())
+                continue;
+            line.sprnt("watch %s", kv.second.c_str());
+            if (!client.send_line(line))
+                return;
+            subscribed.insert(kv);
+        }
+        b_dirty = false;
+    }
+
+    // Connects and subscribes all the files again
+    bool reconnect()
+    {
+        if (!connect())
+            return false;
+
+        subscribed.clear();
+        b_dirty = true;
+        sync();
+        return client.is_connected();
+    }
+
+    // The watch set is sent to the hub on the next drain, once complete
+    bool add_dir(const char *, const qstrvec_t &dir_files) override
+    {
+        for (auto &file: dir_files)
+            files.emplace(filemon_key(file.c_str()), file);
+        b_dirty = true;
+        return true;
+    }
+
+    void clear() override
+    {
+        files.clear();
+        b_dirty = true;
+    }
+
+    bool drain(filemon_changes_t &changes) override
+    {
+        if (!client.is_connected())
+        {
+            // Polling meanwhile
+            if (is_retry_due())
+                reconnect();
+            return false;
+        }
+        sync();
+
+        // 'rescan': only the files are checked again, the watch set stays as is
+        qstrvec_t lines;
+        bool ok = client.read_lines(lines);
+        for (auto &line: lines)
+        {
+            if (strncmp(line.c_str(), "changed ", 8) == 0)
+                changes.insert(filemon_key(line.c_str() + 8));
+            else if (line == "rescan")
+                ok = false;
+            else if (strncmp(line.c_str(), "error ", 6) == 0)
+                msg("QScripts: shared watcher: %s\n", line.c_str() + 6);
+        }
+
+        // The hub went away: connect to the next one (or take over) right away
+        if (!client.is_connected())
+            reconnect();
+        return ok;
+    }
+};